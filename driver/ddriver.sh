@@ -41,6 +41,20 @@ function usage(){
     echo "-l            显示ddriver的Log"
     echo "-v            显示ddriver的类型[内核模块 / 用户静态链接库]"
     echo "-h            打印本帮助菜单"
+    echo "用户态ddriver的大小、IO单位和延迟可在 <镜像路径>_conf (默认 ~/ddriver_conf) 中按 KEY=VALUE 配置, 或用同名环境变量覆盖:"
+    echo "  DDRIVER_DISK_SZ (如1G) DDRIVER_IO_SZ DDRIVER_TRACK_NUM"
+    echo "  DDRIVER_READ_LAT_US DDRIVER_WRITE_LAT_US DDRIVER_SEEK_LAT_US"
+    echo "  DDRIVER_VIRTUAL_TIME=1 只累计模型延迟而不真正睡眠"
+    echo "  DDRIVER_MMAP=1 以mmap方式访问镜像, DDRIVER_MAP_ACCOUNT=1 将原地访问计入统计"
+    echo "  DDRIVER_DIRECT=1 以O_DIRECT绕过页缓存, DDRIVER_DSYNC=1 以O_DSYNC同步写"
+    echo "  DDRIVER_QUEUE_DEPTH 异步接口（ddriver_submit/ddriver_reap）的队列深度, 默认32"
+    echo "  DDRIVER_MEMBERS=img1,img2,... 由多个镜像按 DDRIVER_STRIPE_SZ (默认64K) 条带组成RAID-0设备"
+    echo "  DDRIVER_TRACE=<文件> 记录块IO轨迹, 可用 ddriver-replay 在其他延迟模型下重放"
+    echo "  DDRIVER_LAT_DIST=const|lognormal|bimodal 读写延迟分布, lognormal的sigma由 DDRIVER_LAT_SIGMA_PM (千分之一, 默认500) 给出,"
+    echo "    bimodal以 DDRIVER_STALL_PPM (默认1000) 的概率额外停顿 DDRIVER_STALL_US (默认100ms)"
+    echo "  DDRIVER_GC_PERIOD_US DDRIVER_GC_PAUSE_US 模型时钟每经过一个周期停顿一次, 模拟GC"
+    echo "  DDRIVER_EIO_PPM 每次读写返回EIO的概率 (百万分之一), DDRIVER_SEED 随机数种子"
+    echo "内核ddriver的大小在安装时取 DDRIVER_DISK_SZ (如1G, 默认4M), 即模块参数 disk_size"
     echo "===================================================================="
 }
 
@@ -80,7 +94,7 @@ function install() {
         sudo rm $KERNEL_DEV_PATH>/dev/null 2>&1 
         sudo rmmod ddriver>/dev/null 2>&1 
         sudo dmesg -C
-        sudo insmod ./ddriver.ko
+        sudo insmod ./ddriver.ko ${DDRIVER_DISK_SZ:+disk_size=$DDRIVER_DISK_SZ}
         in=$(dmesg | tail -n 1)
         tokens=("$in")
         major_number=${tokens[${#tokens[*]}-1]}
@@ -141,14 +155,34 @@ function log() {
     fi
 }
 
+# 用户态设备大小可由 ~/ddriver_conf 或 DDRIVER_DISK_SZ 配置，按镜像实际大小计算块数
+function user_block_count() {
+    if [ -f "$USER_DEV_PATH" ]; then
+        echo $(( $(stat -c %s "$USER_DEV_PATH") / CONFIG_BLOCK_SZ ))
+    else
+        echo $BLOCK_COUNT
+    fi
+}
+
+# 内核设备大小为模块参数disk_size，可带K/M/G后缀
+function kernel_block_count() {
+    local sz
+    sz=$(cat /sys/module/ddriver/parameters/disk_size 2>/dev/null)
+    if [ -n "$sz" ]; then
+        echo $(( $(numfmt --from=iec "${sz^^}") / CONFIG_BLOCK_SZ ))
+    else
+        echo $BLOCK_COUNT
+    fi
+}
+
 function dump(){
     sudo rm "$ORIGIN_WORK_DIR"/ddriver_dump>/dev/null 2>&1 
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
-        sudo dd if=$KERNEL_DEV_PATH of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        sudo dd if=$KERNEL_DEV_PATH of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$(kernel_block_count)
     else 
         echo "目标设备 $USER_DEV_PATH"
-        dd if="$USER_DEV_PATH" of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        dd if="$USER_DEV_PATH" of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$(user_block_count)
     fi
     echo "文件已导出至$ORIGIN_WORK_DIR/ddriver_dump，请安装HexEditor插件查看其内容"
 }
@@ -156,10 +190,10 @@ function dump(){
 function clean(){
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
-        sudo dd if=/dev/zero of=$KERNEL_DEV_PATH bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        sudo dd if=/dev/zero of=$KERNEL_DEV_PATH bs=$CONFIG_BLOCK_SZ count=$(kernel_block_count)
     else
         echo "目标设备 $USER_DEV_PATH"
-        dd if=/dev/zero of="$USER_DEV_PATH" bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        dd if=/dev/zero of="$USER_DEV_PATH" bs=$CONFIG_BLOCK_SZ count=$(user_block_count)
     fi 
 }
 
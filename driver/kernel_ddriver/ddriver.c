@@ -4,6 +4,11 @@
 #include <linux/fs.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include "ddriver_ctl.h"
 /******************************************************************************
 * SECTION: Macro definitions
@@ -27,8 +32,9 @@
                         "filp_open/cpp-filp_open-function-examples.html>"
 #define DRIVER_VERSION  "0.1.0"
 
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
 #define CONFIG_BLOCK_SZ (512)
+#define LAT_OP_READ     0
+#define LAT_OP_WRITE    1
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
@@ -51,46 +57,187 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR(DRIVER_AUTHOR);	    
 MODULE_DESCRIPTION(DRIVER_DESC);	
 MODULE_VERSION(DRIVER_VERSION);	
+
+static char *disk_size = "4M";                        /* 设备大小，可带K/M/G后缀 */
+module_param(disk_size, charp, 0444);
+MODULE_PARM_DESC(disk_size, "Disk size, a multiple of 512 bytes, K/M/G suffix allowed (default 4M)");
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
 struct ddriver
 {
-    char layout[CONFIG_DISK_SZ];                      /* Disk Layout */
+    char *layout;                                     /* Disk Layout, 加载时按disk_size分配 */
     char *head;                                       /* Disk Head */
     int  read_cnt;
     int  write_cnt;
     int  seek_cnt;
     int  major_num;
     int  open_count;
-    int  layout_size;
+    loff_t layout_size;
     int  iounit_size;
+    struct mutex lock;                                /* 保证单次IO原子 */
+    atomic_t inflight;                                /* 进入读写、含等锁的IO数 */
+    int  inflight_hwm;
+    unsigned long long bytes[2];                      /* 按读/写分别累计的字节数 */
+    unsigned long long clock_us;                      /* 读写实际耗时之和 */
+    unsigned long long lat_hist[2][DDRIVER_HIST_BUCKETS];
+    unsigned long long seek_hist[DDRIVER_HIST_BUCKETS];
 };
 
 static struct ddriver disk = {
+    .layout      = NULL,
     .head        = NULL,
     .read_cnt    = 0,
     .write_cnt   = 0,
     .seek_cnt    = 0,
     .major_num   = 0,
     .open_count  = 0,
-    .layout_size = CONFIG_DISK_SZ,
+    .layout_size = 0,
     .iounit_size = CONFIG_BLOCK_SZ
 };
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
 int check_valid(size_t size){
-    if (GET_HEAD_POS(disk) >=  CONFIG_DISK_SZ) {
+    if (GET_HEAD_POS(disk) >= disk.layout_size) {
         kernel_alert("disk head reach the end");
         return -EINVAL;
     }
-    if (size != CONFIG_BLOCK_SZ){
-        kernel_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+    if (size == 0 || size % CONFIG_BLOCK_SZ != 0){
+        kernel_alert("io size %zu should be a multiple of %d", size, CONFIG_BLOCK_SZ);
         return -EIO;
     }
+    if (GET_HEAD_POS(disk) + size > disk.layout_size) {
+        kernel_alert("io [%lld, +%zu) out of device", (long long)GET_HEAD_POS(disk), size);
+        return -EINVAL;
+    }
     return 0;
 }
+/**
+ * @brief log2分桶：0归第0桶，[2^(i-1), 2^i)归第i桶，超出的归最后一桶
+ */
+static int log2_bucket(unsigned long long v) {
+    int b = v == 0 ? 0 : fls64(v);
+    return b < DDRIVER_HIST_BUCKETS ? b : DDRIVER_HIST_BUCKETS - 1;
+}
+/**
+ * @brief 由log2直方图求第pm千分位，结果为所在桶的上界
+ */
+static unsigned long long lat_percentile(unsigned long long *hist, unsigned long long cnt, int pm) {
+    unsigned long long rank = (cnt * pm + 999) / 1000, seen = 0;
+    int b;
+    if (cnt == 0) {
+        return 0;
+    }
+    for (b = 0; b < DDRIVER_HIST_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return b == 0 ? 0 : (1ULL << b) - 1;
+}
+/**
+ * @brief 在磁盘头处读写size字节，计入耗时和统计
+ * 
+ * @param buf           User space buffer
+ * @param size          IO单位的整数倍
+ * @param op            LAT_OP_READ / LAT_OP_WRITE
+ * @return ssize_t      Bytes have been read or written
+ */
+static ssize_t disk_rw(char __user *buf, size_t size, int op) {
+    ssize_t ret;
+    u64 start;
+    unsigned long long us;
+    int depth = atomic_inc_return(&disk.inflight);
+
+    mutex_lock(&disk.lock);
+    if (depth > disk.inflight_hwm) {
+        disk.inflight_hwm = depth;
+    }
+    ret = check_valid(size);
+    if (ret < 0) {
+        goto out;
+    }
+    start = ktime_get_ns();
+    if (op == LAT_OP_WRITE ? copy_from_user(disk.head, buf, size) : 
+                             copy_to_user(buf, disk.head, size)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    us = (ktime_get_ns() - start) / 1000;
+    FORWARD_HEAD(disk, size);
+    if (op == LAT_OP_WRITE) {
+        INC_WRITECNT(disk);
+    }
+    else {
+        INC_READCNT(disk);
+    }
+    disk.bytes[op] += size;
+    disk.clock_us  += us;
+    disk.lat_hist[op][log2_bucket(us)]++;
+    ret = size;
+out:
+    mutex_unlock(&disk.lock);
+    atomic_dec(&disk.inflight);
+    return ret;
+}
+/**
+ * @brief 清零统计，不改动磁盘内容，调用者需持有disk.lock
+ */
+static void reset_stats(void) {
+    disk.read_cnt = 0;
+    disk.write_cnt = 0;
+    disk.seek_cnt = 0;
+    disk.clock_us = 0;
+    disk.inflight_hwm = atomic_read(&disk.inflight);
+    memset(disk.bytes, 0, sizeof(disk.bytes));
+    memset(disk.lat_hist, 0, sizeof(disk.lat_hist));
+    memset(disk.seek_hist, 0, sizeof(disk.seek_hist));
+}
+/**
+ * @brief 填充带版本的统计，只回写调用者给出的size
+ * 
+ * @param arg           User space struct ddriver_stats
+ * @return long         State
+ */
+static long fill_stats(struct ddriver_stats __user *arg) {
+    struct ddriver_stats *stats;
+    unsigned int size;
+    long ret = 0;
+
+    if (get_user(size, &arg->size)) {
+        return -EFAULT;
+    }
+    if (size < 2 * sizeof(unsigned int)) {
+        return -EINVAL;
+    }
+    stats = kzalloc(sizeof(struct ddriver_stats), GFP_KERNEL);  /* 对内核栈来说过大 */
+    if (stats == NULL) {
+        return -ENOMEM;
+    }
+    mutex_lock(&disk.lock);
+    stats->version         = DDRIVER_STATS_VERSION;
+    stats->size            = min_t(unsigned int, size, sizeof(struct ddriver_stats));
+    stats->read_cnt        = disk.read_cnt;
+    stats->write_cnt       = disk.write_cnt;
+    stats->seek_cnt        = disk.seek_cnt;
+    stats->queue_depth_hwm = disk.inflight_hwm;
+    stats->read_bytes      = disk.bytes[LAT_OP_READ];
+    stats->write_bytes     = disk.bytes[LAT_OP_WRITE];
+    stats->clock_us        = disk.clock_us;
+    memcpy(stats->read_lat_hist, disk.lat_hist[LAT_OP_READ], sizeof(stats->read_lat_hist));
+    memcpy(stats->write_lat_hist, disk.lat_hist[LAT_OP_WRITE], sizeof(stats->write_lat_hist));
+    memcpy(stats->seek_dist_hist, disk.seek_hist, sizeof(stats->seek_dist_hist));
+    stats->read_p999_us    = lat_percentile(disk.lat_hist[LAT_OP_READ], disk.read_cnt, 999);
+    stats->write_p999_us   = lat_percentile(disk.lat_hist[LAT_OP_WRITE], disk.write_cnt, 999);
+    mutex_unlock(&disk.lock);
+    if (copy_to_user(arg, stats, stats->size)) {
+        ret = -EFAULT;
+    }
+    kfree(stats);
+    return ret;
+}
 /******************************************************************************
 * SECTION: Function definitions
 *******************************************************************************/
@@ -119,7 +266,7 @@ static struct file_operations file_ops = {
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
+ * @param size          A multiple of Blocksize @CONFIG_BLOCK_SZ
  * @param offset        Ignored
  * @return ssize_t      Bytes have been read 
  */
@@ -127,21 +274,14 @@ static ssize_t
 device_read(struct file *file, char *user_buffer, size_t size, loff_t *offset) {
     IGNORE_ARG(offset);
     IGNORE_ARG(file);
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
-    if (copy_to_user(user_buffer, disk.head, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    return disk_rw((char __user *)user_buffer, size, LAT_OP_READ);
 }
 /**
  * @brief Disk Write
  * 
  * @param file          Ignored
  * @param user_buffer   User space buffer, copy content from
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
+ * @param size          A multiple of Blocksize @CONFIG_BLOCK_SZ
  * @param offset        Ignored
  * @return ssize_t      Bytes have been written
  */
@@ -149,15 +289,7 @@ static ssize_t
 device_write(struct file *file, const char *user_buffer, size_t size, loff_t *offset) {
     IGNORE_ARG(offset);
     IGNORE_ARG(file);
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
-
-    if (copy_from_user(disk.head, user_buffer, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    return disk_rw((char __user *)user_buffer, size, LAT_OP_WRITE);
 }
 /**
  * @brief Disk Seek
@@ -169,25 +301,36 @@ device_write(struct file *file, const char *user_buffer, size_t size, loff_t *of
  */
 static loff_t 
 device_seek(struct file *file, loff_t offset, int whence) {
+    loff_t pos;
     IGNORE_ARG(file);
     if (!IS_ADDR_ALIGN(offset)) {
         kernel_alert("offset %lld must be aligned to block size %d", 
                       offset, CONFIG_BLOCK_SZ);
         return -EINVAL;
     }
+    mutex_lock(&disk.lock);
     switch (whence)
     {
     case SEEK_SET:
-        SET_HEAD(disk, offset);
+        pos = offset;
         break;
     case SEEK_CUR:
-        FORWARD_HEAD(disk, offset);
+        pos = GET_HEAD_POS(disk) + offset;
         break;
     default:
+        pos = GET_HEAD_POS(disk);
         break;
     }
+    if (pos < 0 || pos > disk.layout_size) {
+        mutex_unlock(&disk.lock);
+        kernel_alert("seek to %lld out of device", pos);
+        return -EINVAL;
+    }
+    disk.seek_hist[log2_bucket(abs(pos - GET_HEAD_POS(disk)) / CONFIG_BLOCK_SZ)]++;
+    SET_HEAD(disk, pos);
     INC_SEEKCNT(disk);
-    return GET_HEAD_POS(disk);
+    mutex_unlock(&disk.lock);
+    return pos;
 }
 /**
  * @brief Disk ioctl
@@ -200,12 +343,14 @@ device_seek(struct file *file, loff_t offset, int whence) {
 static long 
 device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
     IGNORE_ARG(file);
-    int ret;
+    int ret, size;
     struct ddriver_state state;
+    struct ddriver_geometry geo;
     switch (cmd)
     {
-    case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        ret = copy_to_user((int __user *)arg, &disk.layout_size, sizeof(int));
+    case IOC_REQ_DEVICE_SIZE:                         /* Device Size, 超过2GB时截断，请用GEOMETRY */
+        size = disk.layout_size > INT_MAX ? INT_MAX : (int)disk.layout_size;
+        ret = copy_to_user((int __user *)arg, &size, sizeof(int));
         if (ret) 
             return -EFAULT;
         break;
@@ -218,16 +363,32 @@ device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
             return -EFAULT;
         break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
+        mutex_lock(&disk.lock);
         disk.head = disk.layout;
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        reset_stats();
+        mutex_unlock(&disk.lock);
         break;
     case IOC_REQ_DEVICE_IO_SZ:
         ret = copy_to_user((int __user *)arg, &disk.iounit_size, sizeof(int));
         if (ret) 
             return -EFAULT;
         break;
+    case IOC_REQ_DEVICE_GEOMETRY:                     /* Device Geometry, 内核驱动没有延迟模型 */
+        memset(&geo, 0, sizeof(struct ddriver_geometry));
+        geo.disk_size   = disk.layout_size;
+        geo.iounit_size = disk.iounit_size;
+        geo.track_num   = 1;
+        ret = copy_to_user((void __user *)arg, &geo, sizeof(struct ddriver_geometry));
+        if (ret) 
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_RESET_STATS:                  /* 只清零统计，不擦除磁盘 */
+        mutex_lock(&disk.lock);
+        reset_stats();
+        mutex_unlock(&disk.lock);
+        break;
+    case IOC_REQ_DEVICE_STATS:                        /* Versioned Stats */
+        return fill_stats((struct ddriver_stats __user *)arg);
     default:
         break;
     }
@@ -276,16 +437,35 @@ device_release(struct inode *inode, struct file *file) {
 static int __init 
 ddriver_init(void)
 {
-    int major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
+    char *end;
+    int major_num;
+    unsigned long long size = memparse(disk_size, &end);
+
+    if (*end != '\0' || size == 0 || size % CONFIG_BLOCK_SZ != 0) {
+        kernel_alert("disk_size %s should be a nonzero multiple of %d", disk_size, CONFIG_BLOCK_SZ);
+        return -EINVAL;
+    }
+    disk.layout = vzalloc(size);                      /* 大镜像超出kmalloc的连续物理内存 */
+    if (disk.layout == NULL) {
+        kernel_alert("Can't allocate %llu bytes", size);
+        return -ENOMEM;
+    }
+    disk.layout_size = size;
+    mutex_init(&disk.lock);
+    atomic_set(&disk.inflight, 0);
+    kernel_info("disk size %llu bytes", size);
+
+    major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
                                                       /* Register an device */
     if (major_num < 0) {                              /* Register fail */
         kernel_alert("Can't register device, ret %d", major_num);
+        vfree(disk.layout);
+        disk.layout = NULL;
         return major_num;
     } 
     else {                                            /* Register success */                                                  
         kernel_info("module loaded with device major number %d", major_num);
         disk.major_num = major_num;
-        memset(disk.layout, 0, CONFIG_DISK_SZ);
         return 0;
     }
     return 0;
@@ -299,6 +479,7 @@ ddriver_exit(void)
     if(major_num != 0){
         unregister_chrdev(major_num, DEVICE_NAME);
     }
+    vfree(disk.layout);
 }
 
 module_init(ddriver_init);
@@ -13,9 +13,54 @@ struct ddriver_state
     int seek_cnt;
 };
 
+struct ddriver_geometry
+{
+    unsigned long long disk_size;                   /* 设备大小，字节 */
+    int iounit_size;                                /* IO单位，字节 */
+    int track_num;
+    int read_lat_us;
+    int write_lat_us;
+    int seek_lat_us;                                /* 转过一整个磁道的延迟 */
+    int virtual_time;                               /* 非0时只累计模型时间，不真正睡眠 */
+};
+
+#define DDRIVER_STATS_VERSION   4
+#define DDRIVER_HIST_BUCKETS    40                  /* 第0桶为0，第i桶为[2^(i-1), 2^i) */
+/* 与用户态ddriver的布局相同。调用前置size为调用者所知的结构大小，驱动只填充前size
+ * 字节并回写version和实际size，新版本只在末尾追加字段 */
+struct ddriver_stats
+{
+    unsigned int version;
+    unsigned int size;
+    int read_cnt;
+    int write_cnt;
+    int seek_cnt;
+    int queue_depth_hwm;                            /* 同时在途IO数的最大值 */
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+    unsigned long long clock_us;                    /* 内核驱动没有延迟模型，为读写实际耗时之和 */
+    unsigned long long seek_us;
+    unsigned long long read_lat_hist[DDRIVER_HIST_BUCKETS];   /* 单位us */
+    unsigned long long write_lat_hist[DDRIVER_HIST_BUCKETS];
+    unsigned long long seek_dist_hist[DDRIVER_HIST_BUCKETS];  /* 单位为IO单位 */
+    /* version 2 */
+    unsigned long long discard_cnt;
+    unsigned long long discard_bytes;
+    /* version 3 */
+    unsigned long long flush_cnt;
+    /* version 4 */
+    unsigned long long read_p999_us;
+    unsigned long long write_p999_us;
+    unsigned long long stall_cnt;
+    unsigned long long eio_cnt;
+};
+
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)
+#define IOC_REQ_DEVICE_GEOMETRY     _IOR(IOC_MAGIC, 4, struct ddriver_geometry)
+#define IOC_REQ_DEVICE_RESET_STATS  _IO(IOC_MAGIC, 7)
+#define IOC_REQ_DEVICE_STATS        _IOWR(IOC_MAGIC, 8, struct ddriver_stats)
 
 #endif
\ No newline at end of file
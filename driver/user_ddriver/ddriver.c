@@ -1,3 +1,4 @@
+#define _GNU_SOURCE                                  /* fallocate */
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
@@ -5,11 +6,16 @@
 #include <fcntl.h>
 #include "string.h"
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include "ddriver_ctl.h"
 #include "stdio.h"
 #include "errno.h"
 #include <pwd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <limits.h>
 
 extern int errno;
 
@@ -21,18 +27,19 @@ extern int errno;
 * SECTION: Macro definitions
 *******************************************************************************/   
 #define DEVICE_NAME   "ddriver"
-#define DEVICE_LOG    "ddriver_log"
+#define DEVICE_LOG    "_log"                         /* 日志和配置文件为镜像路径加后缀 */
+#define DEVICE_CONF   "_conf"
 
-#define user_info(fmt, ...)\
+#define user_info(d, fmt, ...)\
 	do {\
 		printf(USER_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+        fprintf((d)->log, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
 	} while(0)\
 
-#define user_alert(fmt, ...)\
+#define user_alert(d, fmt, ...)\
 	do {\
 		printf(USER_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+        fprintf((d)->log, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
 	} while(0)\
 
 #define user_panic(fmt, ...)\
@@ -44,121 +51,1325 @@ extern int errno;
 #define DRIVER_DESC     "A Fake disk driver in user space"
 #define DRIVER_VERSION  "0.1.0"
 
+/* 以下为默认值，可由 ~/ddriver_conf、环境变量或 IOC_REQ_DEVICE_SET_GEOMETRY 覆盖 */
 #define CONFIG_DISK_SZ  (4 * 1024 * 1024)
 #define CONFIG_BLOCK_SZ (512)
+#define CONFIG_MIN_BLOCK_SZ (512)
+#define CONFIG_QUEUE_DEPTH  (32)
+#define CONFIG_STRIPE_SZ    (64 * 1024)
+#define MAX_MEMBERS         8
+#define MAX_DISKS           64                       /* 一个进程内同时打开的实例数 */
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(d, addr)  ((addr) % (d)->iounit_size == 0)
+#define ADDR_ROUND_UP(d, addr)  (((addr) / (d)->iounit_size) * (d)->iounit_size)
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+#define INC_READCNT(d)          ((d)->read_cnt++)
+#define INC_WRITECNT(d)         ((d)->write_cnt++)
+#define INC_SEEKCNT(d)          ((d)->seek_cnt++)
 
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
+/* 服务时间直方图：小于16us逐微秒计，之后每个2的幂区间再分16格，相对误差不超过1/16 */
+#define LAT_SUB_BITS            4
+#define LAT_SUB_CNT             (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS             ((64 - LAT_SUB_BITS + 1) * LAT_SUB_CNT)
+#define LAT_OP_READ             0
+#define LAT_OP_WRITE            1
+#define ZERO_BUF_SZ             4096
+#define DIRECT_ALIGN            4096                 /* O_DIRECT对Buf地址的对齐要求，取常见页大小 */
+/* 读写延迟的分布，由DDRIVER_LAT_DIST选择 */
+#define LAT_DIST_CONST          0                    /* 恒为读/写延迟 */
+#define LAT_DIST_LOGNORMAL      1                    /* 对数正态，中位数为读/写延迟 */
+#define LAT_DIST_BIMODAL        2                    /* 以一定概率额外停顿 */
+#define PPM                     1000000
+#define MAX_LAT_SIGMA_PM        2000
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
+/* RAID-0的一个成员镜像，各自有磁盘头和锁，不同成员上的IO可以重叠 */
+struct ddriver_member
+{
+    int  fd;
+    off_t head;
+    pthread_mutex_t lock;
+};
+
+/* 异步提交/完成环，由一个工作线程按提交顺序服务；完成项不记录提交者，提交和取回需由调用者串行化 */
+struct ddriver_ring
+{
+    pthread_mutex_t     lock;
+    pthread_cond_t      sq_cond;                     /* 有新请求，唤醒工作线程 */
+    pthread_cond_t      cq_cond;                     /* 有新完成项，唤醒reap */
+    struct ddriver_sqe *sq;
+    struct ddriver_cqe *cq;
+    int                 depth;
+    unsigned int        sq_head, sq_tail;            /* 单调递增，取模depth定位 */
+    unsigned int        cq_head, cq_tail;
+    int                 pending;                     /* 已提交未被reap的请求数，不超过depth */
+    int                 busy[MAX_MEMBERS];           /* 各槽位是否有已取出、尚未完成的请求 */
+    unsigned int        busy_seq[MAX_MEMBERS];       /* 该请求的序号，即取出时的sq_head */
+    int                 running;
+    int                 stop;
+    int                 nworkers;                    /* 单镜像为1，条带时每个成员一个 */
+    pthread_t           workers[MAX_MEMBERS];
+};
+
+/* 一个打开的设备实例，各实例的镜像、几何参数、统计和日志互相独立 */
 struct ddriver
 {
-    int  ddriver_fd;                                 /* Disk ddriver_fd */
+    int  ddriver_fd;                                 /* Disk ddriver_fd，也是实例的句柄 */
+    char path[PATH_MAX];                             /* 镜像路径 */
+    FILE *log;
     int  read_cnt;
     int  write_cnt;
     int  seek_cnt;
-    int  read_lat;
-    int  write_lat;
-    int  seek_lat;
+    int  read_lat_us;                                /* 单次读延迟，微秒 */
+    int  write_lat_us;                               /* 单次写延迟，微秒 */
+    int  seek_lat_us;                                /* 转过一整个磁道的延迟，微秒 */
     int  track_num;
     int  major_num;
-    int  layout_size;
+    off_t layout_size;                               /* 设备大小，字节 */
     int  iounit_size;
+    off_t head;                                      /* 磁盘头当前位置 */
+    off_t cursor;                                    /* seek/read兼容接口的读写位置 */
+    pthread_mutex_t lock;                            /* 保证单次IO原子 */
+    int  virtual_time;                               /* 非0时只累计模型时间，不真正睡眠 */
+    unsigned long long clock_us;                     /* 模型时钟，所有服务时间之和 */
+    unsigned long long seek_us;                      /* 其中寻道与旋转的部分 */
+    unsigned long long lat_total_us[2];              /* 按读/写分别累计 */
+    unsigned long long lat_max_us[2];
+    unsigned long long lat_hist[2][LAT_BUCKETS];     /* 单次IO服务时间的分布 */
+    unsigned long long bytes[2];                     /* 按读/写分别累计的字节数 */
+    unsigned long long seek_hist[DDRIVER_HIST_BUCKETS]; /* 寻道距离（IO单位）的log2分布 */
+    unsigned long long discard_cnt;
+    unsigned long long discard_bytes;
+    int  use_mmap;                                   /* 非0时以mmap方式访问镜像 */
+    int  map_account;                                /* 非0时ddriver_map_block计入读统计和延迟 */
+    int  use_direct;                                 /* 非0时以O_DIRECT打开，绕过宿主机页缓存 */
+    int  use_dsync;                                  /* 非0时以O_DSYNC打开，每次写都落盘 */
+    unsigned long long flush_cnt;
+    char *map;                                       /* 镜像的共享映射，未使用mmap时为NULL */
+    size_t map_size;
+    int  queue_depth;                                /* 异步接口同时在途请求数的上限 */
+    int  inflight;                                   /* 已提交未完成的IO数，含等锁的 */
+    int  inflight_hwm;
+    char member_spec[512];                           /* 逗号分隔的成员镜像路径，空时为单镜像 */
+    int  stripe_size;                                /* 条带单元，字节 */
+    int  member_cnt;                                 /* 0表示单镜像 */
+    struct ddriver_member members[MAX_MEMBERS];
+    struct ddriver_ring ring;
+    char trace_path[PATH_MAX];                       /* 非空时记录块IO轨迹到该文件 */
+    FILE *trace;
+    pthread_mutex_t trace_lock;
+    struct timespec trace_start;
+    int  lat_dist;                                   /* LAT_DIST_* */
+    int  lat_sigma_pm;                               /* 对数正态分布的sigma，单位千分之一 */
+    int  stall_ppm;                                  /* 双峰分布中慢IO的概率，单位百万分之一 */
+    int  stall_us;                                   /* 慢IO额外的停顿 */
+    int  gc_period_us;                               /* 模型时钟每经过这么久停顿一次，0为关闭 */
+    int  gc_pause_us;
+    unsigned long long next_gc_us;
+    int  eio_ppm;                                    /* 每次读写返回EIO的概率，单位百万分之一 */
+    unsigned int seed;                               /* 随机数状态，固定DDRIVER_SEED可复现 */
+    unsigned long long stall_cnt;                    /* 遇到停顿（双峰或GC）的IO数 */
+    unsigned long long eio_cnt;                      /* 注入的EIO数 */
 };
+
 /******************************************************************************
 * SECTION: Global Variable
 *******************************************************************************/
 /* reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
-struct ddriver disk = {
+static const struct ddriver disk_default = {
     .read_cnt    = 0,
     .write_cnt   = 0,
     .seek_cnt    = 0,
-    .read_lat    = 2,       /* 2ms */       
-    .write_lat   = 1,       /* 1ms */
-    .seek_lat    = 4,       /* 4.17ms per 360 degree */
+    .read_lat_us  = 2000,   /* 2ms */       
+    .write_lat_us = 1000,   /* 1ms */
+    .seek_lat_us  = 4000,   /* 4.17ms per 360 degree */
     .major_num   = 0,
     .track_num   = 100,
     .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
+    .iounit_size = CONFIG_BLOCK_SZ,
+    .head        = 0,
+    .cursor      = 0,
+    .virtual_time = 0,
+    .use_mmap    = 0,
+    .map_account = 0,
+    .use_direct  = 0,
+    .use_dsync   = 0,
+    .queue_depth = CONFIG_QUEUE_DEPTH,
+    .stripe_size = CONFIG_STRIPE_SZ,
+    .member_cnt  = 0,
+    .map         = NULL,
+    .lat_dist    = LAT_DIST_CONST,
+    .lat_sigma_pm = 500,
+    .stall_ppm   = 1000,    /* 0.1% */
+    .stall_us    = 100000,  /* 100ms */
+    .gc_period_us = 0,
+    .gc_pause_us = 0,
+    .eio_ppm     = 0,
+    .seed        = 1
+};
+
+/* 已打开的实例，按fd查找 */
+static struct ddriver *disks[MAX_DISKS];
+static pthread_mutex_t disks_lock = PTHREAD_MUTEX_INITIALIZER;
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+int check_valid(struct ddriver *d, size_t size) {
+    if (size != (size_t)d->iounit_size){
+        user_alert(d, "io size %ld should align to %d", size, d->iounit_size);
+        return -EIO;
+    }
+    return 0;
+}
+
+int check_valid_range(struct ddriver *d, size_t size) {
+    if (size == 0 || size % d->iounit_size != 0){
+        user_alert(d, "io size %ld should be a multiple of %d", size, d->iounit_size);
+        return -EIO;
+    }
+    return 0;
+}
+
+int check_valid_addr(struct ddriver *d, off_t offset, size_t size) {
+    if (!IS_ADDR_ALIGN(d, offset)) {
+        user_alert(d, "offset %ld must be aligned to block size %d", 
+                      offset, d->iounit_size);
+        return -EINVAL;
+    }
+    if (offset < 0 || offset + (off_t)size > d->layout_size) {
+        user_alert(d, "io [%ld, +%ld) out of device", offset, size);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief 镜像不足size时用ftruncate稀疏地扩展，不预先占用宿主机空间
+ * 
+ * @param fd 
+ * @param size 
+ * @return int 
+ */
+static int grow_image(int fd, off_t size) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+    if (st.st_size < size && ftruncate(fd, size) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+/**
+ * @brief 将[offset, offset + len)清零并释放宿主机上的空间
+ * 
+ * 优先打洞；文件系统不支持时，整盘清零退化为截断重建，部分清零退化为写零
+ * 
+ * @param fd 
+ * @param offset 
+ * @param len 
+ * @return int 
+ */
+static int zero_range(struct ddriver *d, int fd, off_t offset, off_t len) {
+    static const char zeros[ZERO_BUF_SZ] __attribute__((aligned(DIRECT_ALIGN))) = {'\0'};
+    off_t pos;
+    size_t chunk;
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
+    }
+    if (offset == 0 && len == d->layout_size) {
+        if (ftruncate(fd, 0) == 0 && ftruncate(fd, len) == 0) {
+            return 0;
+        }
+    }
+    for (pos = offset; pos < offset + len; pos += chunk) {
+        chunk = offset + len - pos < ZERO_BUF_SZ ? offset + len - pos : ZERO_BUF_SZ;
+        if (pwrite(fd, zeros, chunk, pos) != (ssize_t)chunk) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 按当前设备大小建立镜像映射，已有映射时重建，调用者需持有d->lock或尚未并发
+ * 
+ * @param fd 
+ * @return int 
+ */
+static int map_image(struct ddriver *d, int fd) {
+    char *map;
+
+    if (!d->use_mmap || (d->map != NULL && d->map_size == (size_t)d->layout_size)) {
+        return 0;
+    }
+    map = mmap(NULL, d->layout_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    if (d->map != NULL) {
+        munmap(d->map, d->map_size);
+    }
+    d->map      = map;
+    d->map_size = d->layout_size;
+    return 0;
+}
+/**
+ * @brief 后端读写：mmap后端直接拷贝映射，否则走pread/pwrite；O_DIRECT下Buf未对齐时经对齐的中转Buf
+ */
+static ssize_t backend_rw(struct ddriver *d, int fd, char *buf, size_t size, off_t offset, int is_write) {
+    void *bounce;
+    ssize_t ret;
+
+    if (d->map != NULL) {
+        if (is_write) memcpy(d->map + offset, buf, size);
+        else          memcpy(buf, d->map + offset, size);
+        return size;
+    }
+    if (!d->use_direct || (unsigned long)buf % DIRECT_ALIGN == 0) {
+        return is_write ? pwrite(fd, buf, size, offset) : pread(fd, buf, size, offset);
+    }
+    if (posix_memalign(&bounce, DIRECT_ALIGN, size) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (is_write) {
+        memcpy(bounce, buf, size);
+        ret = pwrite(fd, bounce, size, offset);
+    }
+    else {
+        ret = pread(fd, bounce, size, offset);
+        if (ret > 0) {
+            memcpy(buf, bounce, ret);
+        }
+    }
+    free(bounce);
+    return ret;
+}
+/**
+ * @brief 打开镜像，O_DIRECT不被宿主机文件系统支持时退回带缓存的方式
+ * 
+ * @param path 
+ * @param flags 
+ * @return int 
+ */
+static int open_image(struct ddriver *d, const char *path, int flags) {
+    int fd;
+
+    if (d->use_dsync) {
+        flags |= O_DSYNC;
+    }
+    if (d->use_direct) {
+        fd = open(path, flags | O_DIRECT, 0644);
+        if (fd >= 0 || errno != EINVAL) {
+            return fd;
+        }
+        user_panic("O_DIRECT not supported on [%s], fall back to buffered io", path);
+        d->use_direct = 0;
+    }
+    return open(path, flags, 0644);
+}
+/**
+ * @brief 经过us微秒的模型时间，虚拟时间模式下不睡眠
+ * 
+ * @param us 
+ */
+static void emulate_delay(struct ddriver *d, int us) {
+    if (us > 0 && !d->virtual_time) {
+        usleep(us);
+    }
+}
+/**
+ * @brief 在大小为span的盘面上从start旋转到end所需的模型时间，不睡眠
+ */
+static int rotate_us(struct ddriver *d, off_t start, off_t end, off_t span) {
+    long long bytes_per_track = span / d->track_num;
+    long long lat_per_track = d->seek_lat_us;
+    long long distance;
+    
+    if (bytes_per_track <= 0) {
+        return 0;
+    }
+    distance = llabs(end - start) % bytes_per_track; 
+    return distance * lat_per_track / bytes_per_track;
+}
+/**
+ * @brief 模拟从start旋转到end
+ * 
+ * @return int 模型延迟，微秒
+ */
+int emulate_rotate(struct ddriver *d, off_t start, off_t end) {
+    int us = rotate_us(d, start, end, d->layout_size);
+    emulate_delay(d, us);
+    return us;
+}
+/**
+ * @brief [0, 1)上的均匀随机数，调用者需持有d->lock
+ */
+static double rand_unit(struct ddriver *d) {
+    return rand_r(&d->seed) / ((double)RAND_MAX + 1);
+}
+/**
+ * @brief 求e^x，不依赖libm，链接libddriver.a的文件系统不必再加-lm
+ */
+static double exp_approx(double x) {
+    double r = 1, term = 1;
+    int k = 0, i;
+
+    for (; x > 0.5; x -= 0.6931471805599453, k++);  /* x = k*ln2 + r, |r| <= 0.5 */
+    for (; x < -0.5; x += 0.6931471805599453, k--);
+    for (i = 1; i < 12; i++) {
+        term *= x / i;
+        r    += term;
+    }
+    return k >= 0 ? r * (1ULL << k) : r / (1ULL << -k);
+}
+/**
+ * @brief 按延迟分布抽取一次读写的服务时间，不含寻道，调用者需持有d->lock
+ *
+ * 对数正态分布的正态变量取12个均匀变量之和减6，尾部截断在6sigma；GC停顿与分布
+ * 无关，模型时钟每经过gc_period_us，之后的第一个IO额外等待gc_pause_us
+ *
+ * @param base 读/写延迟
+ * @return int 微秒
+ */
+static int lat_sample(struct ddriver *d, int base) {
+    double us = base, z = -6;
+    int i, stalled = 0;
+
+    if (d->lat_dist == LAT_DIST_LOGNORMAL) {
+        for (i = 0; i < 12; i++) {
+            z += rand_unit(d);
+        }
+        us = base * exp_approx(z * d->lat_sigma_pm / 1000);
+    }
+    else if (d->lat_dist == LAT_DIST_BIMODAL && rand_unit(d) * PPM < d->stall_ppm) {
+        us += d->stall_us;
+        stalled = 1;
+    }
+    if (d->gc_period_us > 0 && d->clock_us >= d->next_gc_us) {
+        us += d->gc_pause_us;
+        d->next_gc_us = d->clock_us + d->gc_period_us;
+        stalled = 1;
+    }
+    d->stall_cnt += stalled;
+    return us < INT_MAX ? (int)us : INT_MAX;
+}
+/**
+ * @brief 按DDRIVER_EIO_PPM决定本次读写是否失败，调用者需持有d->lock
+ */
+static int inject_eio(struct ddriver *d) {
+    if (d->eio_ppm > 0 && rand_unit(d) * PPM < d->eio_ppm) {
+        d->eio_cnt++;
+        return 1;
+    }
+    return 0;
+}
+
+static int lat_bucket(unsigned long long us) {
+    int msb;
+    if (us < LAT_SUB_CNT) {
+        return us;
+    }
+    msb = 63 - __builtin_clzll(us);
+    return (msb - LAT_SUB_BITS + 1) * LAT_SUB_CNT 
+         + ((us >> (msb - LAT_SUB_BITS)) & (LAT_SUB_CNT - 1));
+}
+/**
+ * @brief 第b格的上界
+ */
+static unsigned long long lat_bucket_max(int b) {
+    int shift;
+    if (b < LAT_SUB_CNT) {
+        return b;
+    }
+    shift = b / LAT_SUB_CNT - 1;
+    return ((unsigned long long)(LAT_SUB_CNT + b % LAT_SUB_CNT + 1) << shift) - 1;
+}
+/**
+ * @brief 记录一次IO的模型服务时间，调用者需持有d->lock
+ * 
+ * @param op LAT_OP_READ / LAT_OP_WRITE
+ * @param us 
+ */
+static void account_io(struct ddriver *d, int op, unsigned long long us) {
+    d->clock_us += us;
+    d->lat_total_us[op] += us;
+    if (us > d->lat_max_us[op]) {
+        d->lat_max_us[op] = us;
+    }
+    d->lat_hist[op][lat_bucket(us)]++;
+}
+/**
+ * @brief 由直方图求第pm千分位，结果为所在格的上界
+ */
+static unsigned long long lat_percentile(struct ddriver *d, int op, unsigned long long cnt, int pm) {
+    unsigned long long rank = (cnt * pm + 999) / 1000, seen = 0;
+    int b;
+    if (cnt == 0) {
+        return 0;
+    }
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += d->lat_hist[op][b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return lat_bucket_max(b) < d->lat_max_us[op] ? lat_bucket_max(b) : d->lat_max_us[op];
+}
+
+/**
+ * @brief log2分桶：0归第0桶，[2^(i-1), 2^i)归第i桶，超出的归最后一桶
+ */
+static int log2_bucket(unsigned long long v) {
+    int b = v == 0 ? 0 : 64 - __builtin_clzll(v);
+    return b < DDRIVER_HIST_BUCKETS ? b : DDRIVER_HIST_BUCKETS - 1;
+}
+/**
+ * @brief 第b格的下界
+ */
+static unsigned long long lat_bucket_min(int b) {
+    if (b < LAT_SUB_CNT) {
+        return b;
+    }
+    return (unsigned long long)(LAT_SUB_CNT + b % LAT_SUB_CNT) << (b / LAT_SUB_CNT - 1);
+}
+/**
+ * @brief 细分直方图的每一格都落在某个2的幂区间内，可直接折算为log2直方图
+ */
+static void fill_lat_log2(struct ddriver *d, unsigned long long *hist, int op) {
+    int b;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        hist[log2_bucket(lat_bucket_min(b))] += d->lat_hist[op][b];
+    }
+}
+/**
+ * @brief 清零所有统计，不改动磁盘内容，调用者需持有d->lock
+ */
+static void reset_stats(struct ddriver *d) {
+    d->read_cnt = 0;
+    d->write_cnt = 0;
+    d->seek_cnt = 0;
+    d->clock_us = 0;
+    d->seek_us = 0;
+    memset(d->lat_total_us, 0, sizeof(d->lat_total_us));
+    memset(d->lat_max_us, 0, sizeof(d->lat_max_us));
+    memset(d->lat_hist, 0, sizeof(d->lat_hist));
+    memset(d->bytes, 0, sizeof(d->bytes));
+    memset(d->seek_hist, 0, sizeof(d->seek_hist));
+    d->discard_cnt = 0;
+    d->discard_bytes = 0;
+    d->flush_cnt = 0;
+    d->stall_cnt = 0;
+    d->eio_cnt = 0;
+    d->next_gc_us = d->gc_period_us;
+    d->inflight_hwm = d->inflight;
+}
+/**
+ * @brief 记录一个IO进入设备队列
+ */
+static void inflight_inc(struct ddriver *d) {
+    int depth = __atomic_add_fetch(&d->inflight, 1, __ATOMIC_RELAXED);
+    int hwm   = __atomic_load_n(&d->inflight_hwm, __ATOMIC_RELAXED);
+    while (depth > hwm && 
+           !__atomic_compare_exchange_n(&d->inflight_hwm, &hwm, depth, 0, 
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void inflight_dec(struct ddriver *d) {
+    __atomic_sub_fetch(&d->inflight, 1, __ATOMIC_RELAXED);
+}
+
+static void fill_lat(struct ddriver *d, struct ddriver_lat *lat, int op, unsigned long long cnt) {
+    lat->cnt      = cnt;
+    lat->total_us = d->lat_total_us[op];
+    lat->p50_us   = lat_percentile(d, op, cnt, 500);
+    lat->p90_us   = lat_percentile(d, op, cnt, 900);
+    lat->p99_us   = lat_percentile(d, op, cnt, 990);
+    lat->max_us   = d->lat_max_us[op];
+}
+/**
+ * @brief 解析带K/M/G后缀的大小
+ * 
+ * @param str 
+ * @param val 
+ * @return int 
+ */
+static int parse_size(const char *str, long long *val) {
+    char *end;
+    long long v = strtoll(str, &end, 0);
+
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G': v <<= 10; /* fallthrough */
+    case 'M': v <<= 10; /* fallthrough */
+    case 'K': v <<= 10; end++; break;
+    default:  break;
+    }
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (end == str || *end != '\0' || v < 0) {
+        return -EINVAL;
+    }
+    *val = v;
+    return 0;
+}
+static int set_string(char *dst, size_t size, const char *key, const char *value) {
+    if (strlen(value) >= size) {
+        user_panic("%s too long", key);
+        return -EINVAL;
+    }
+    strcpy(dst, value);
+    return 0;
+}
+/**
+ * @brief 检查几何参数：IO单位为不小于512的2的幂，设备大小为IO单位的非零整数倍
+ * 
+ * @param geo 
+ * @return int 
+ */
+static int check_geometry(struct ddriver *d, struct ddriver_geometry *geo) {
+    if (geo->iounit_size < CONFIG_MIN_BLOCK_SZ ||
+        (geo->iounit_size & (geo->iounit_size - 1)) != 0) {
+        user_panic("io unit %d should be a power of 2 and at least %d", 
+                   geo->iounit_size, CONFIG_MIN_BLOCK_SZ);
+        return -EINVAL;
+    }
+    if (geo->disk_size == 0 || geo->disk_size % geo->iounit_size != 0) {
+        user_panic("disk size %llu should be a multiple of io unit %d", 
+                   (unsigned long long)geo->disk_size, geo->iounit_size);
+        return -EINVAL;
+    }
+    if (geo->track_num <= 0 || geo->read_lat_us < 0 || 
+        geo->write_lat_us < 0 || geo->seek_lat_us < 0) {
+        user_panic("invalid latency model");
+        return -EINVAL;
+    }
+    if (d->member_spec[0] != '\0' && 
+        (d->stripe_size <= 0 || d->stripe_size % geo->iounit_size != 0)) {
+        user_panic("stripe size %d should be a multiple of io unit %d", 
+                   d->stripe_size, geo->iounit_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void get_geometry(struct ddriver *d, struct ddriver_geometry *geo) {
+    geo->disk_size    = d->layout_size;
+    geo->iounit_size  = d->iounit_size;
+    geo->track_num    = d->track_num;
+    geo->read_lat_us  = d->read_lat_us;
+    geo->write_lat_us = d->write_lat_us;
+    geo->seek_lat_us  = d->seek_lat_us;
+    geo->virtual_time = d->virtual_time;
+}
+
+static void set_geometry(struct ddriver *d, struct ddriver_geometry *geo) {
+    d->layout_size  = geo->disk_size;
+    d->iounit_size  = geo->iounit_size;
+    d->track_num    = geo->track_num;
+    d->read_lat_us  = geo->read_lat_us;
+    d->write_lat_us = geo->write_lat_us;
+    d->seek_lat_us  = geo->seek_lat_us;
+    d->virtual_time = geo->virtual_time;
+}
+/**
+ * @brief 将一项配置应用到geo，key为环境变量名
+ * 
+ * @param geo 
+ * @param key 
+ * @param value 
+ * @return int 
+ */
+static int apply_config(struct ddriver *d, struct ddriver_geometry *geo, const char *key, const char *value) {
+    long long v;
+
+    if (strcmp(key, "DDRIVER_MEMBERS") == 0) {       /* 字符串配置 */
+        return set_string(d->member_spec, sizeof(d->member_spec), key, value);
+    }
+    if (strcmp(key, "DDRIVER_TRACE") == 0) {
+        return set_string(d->trace_path, sizeof(d->trace_path), key, value);
+    }
+    if (strcmp(key, "DDRIVER_LAT_DIST") == 0) {
+        if (strcmp(value, "const") == 0)          d->lat_dist = LAT_DIST_CONST;
+        else if (strcmp(value, "lognormal") == 0) d->lat_dist = LAT_DIST_LOGNORMAL;
+        else if (strcmp(value, "bimodal") == 0)   d->lat_dist = LAT_DIST_BIMODAL;
+        else {
+            user_panic("bad value for %s: %s, should be const, lognormal or bimodal", key, value);
+            return -EINVAL;
+        }
+        return 0;
+    }
+    if (parse_size(value, &v) < 0) {
+        user_panic("bad value for %s: %s", key, value);
+        return -EINVAL;
+    }
+    if (strcmp(key, "DDRIVER_DISK_SZ") == 0)           geo->disk_size    = v;
+    else if (v > INT_MAX)                             return -EINVAL;
+    else if (strcmp(key, "DDRIVER_IO_SZ") == 0)        geo->iounit_size  = v;
+    else if (strcmp(key, "DDRIVER_TRACK_NUM") == 0)    geo->track_num    = v;
+    else if (strcmp(key, "DDRIVER_READ_LAT_US") == 0)  geo->read_lat_us  = v;
+    else if (strcmp(key, "DDRIVER_WRITE_LAT_US") == 0) geo->write_lat_us = v;
+    else if (strcmp(key, "DDRIVER_SEEK_LAT_US") == 0)  geo->seek_lat_us  = v;
+    else if (strcmp(key, "DDRIVER_VIRTUAL_TIME") == 0) geo->virtual_time = v;
+    else if (strcmp(key, "DDRIVER_MMAP") == 0)         d->use_mmap     = v;
+    else if (strcmp(key, "DDRIVER_MAP_ACCOUNT") == 0)  d->map_account  = v;
+    else if (strcmp(key, "DDRIVER_DIRECT") == 0)       d->use_direct   = v;
+    else if (strcmp(key, "DDRIVER_DSYNC") == 0)        d->use_dsync    = v;
+    else if (strcmp(key, "DDRIVER_QUEUE_DEPTH") == 0)  d->queue_depth  = v > 0 ? v : 1;
+    else if (strcmp(key, "DDRIVER_STRIPE_SZ") == 0)    d->stripe_size  = v;
+    else if (strcmp(key, "DDRIVER_LAT_SIGMA_PM") == 0) d->lat_sigma_pm = v;
+    else if (strcmp(key, "DDRIVER_STALL_PPM") == 0)    d->stall_ppm    = v;
+    else if (strcmp(key, "DDRIVER_STALL_US") == 0)     d->stall_us     = v;
+    else if (strcmp(key, "DDRIVER_GC_PERIOD_US") == 0) d->gc_period_us = v;
+    else if (strcmp(key, "DDRIVER_GC_PAUSE_US") == 0)  d->gc_pause_us  = v;
+    else if (strcmp(key, "DDRIVER_EIO_PPM") == 0)      d->eio_ppm      = v;
+    else if (strcmp(key, "DDRIVER_SEED") == 0)         d->seed         = v;
+    else {
+        user_panic("unknown config %s", key);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const char *config_keys[] = {
+    "DDRIVER_DISK_SZ", "DDRIVER_IO_SZ", "DDRIVER_TRACK_NUM",
+    "DDRIVER_READ_LAT_US", "DDRIVER_WRITE_LAT_US", "DDRIVER_SEEK_LAT_US",
+    "DDRIVER_VIRTUAL_TIME", "DDRIVER_MMAP", "DDRIVER_MAP_ACCOUNT",
+    "DDRIVER_DIRECT", "DDRIVER_DSYNC", "DDRIVER_QUEUE_DEPTH",
+    "DDRIVER_MEMBERS", "DDRIVER_STRIPE_SZ", "DDRIVER_TRACE",
+    "DDRIVER_LAT_DIST", "DDRIVER_LAT_SIGMA_PM", "DDRIVER_STALL_PPM", "DDRIVER_STALL_US",
+    "DDRIVER_GC_PERIOD_US", "DDRIVER_GC_PAUSE_US", "DDRIVER_EIO_PPM", "DDRIVER_SEED"
 };
+/**
+ * @brief 加载设备配置：先读配置文件（每行 KEY=VALUE，#开头为注释），再由同名环境变量覆盖
+ * 
+ * @param conf_path 
+ * @return int 
+ */
+static int load_config(struct ddriver *d, const char *conf_path) {
+    struct ddriver_geometry geo;
+    char line[256], *key, *value, *end;
+    const char *env;
+    FILE *conf;
+    size_t i;
+
+    get_geometry(d, &geo);
+    conf = fopen(conf_path, "r");
+    if (conf != NULL) {
+        while (fgets(line, sizeof(line), conf) != NULL) {
+            key = line;
+            while (isspace((unsigned char)*key)) {
+                key++;
+            }
+            if (*key == '#' || *key == '\0' || (value = strchr(key, '=')) == NULL) {
+                continue;
+            }
+            for (end = value; end > key && isspace((unsigned char)end[-1]); end--);
+            *end = '\0';
+            value++;
+            while (isspace((unsigned char)*value)) {
+                value++;
+            }
+            if (apply_config(d, &geo, key, value) < 0) {
+                fclose(conf);
+                return -EINVAL;
+            }
+        }
+        fclose(conf);
+    }
+    for (i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); i++) {
+        env = getenv(config_keys[i]);
+        if (env != NULL && apply_config(d, &geo, config_keys[i], env) < 0) {
+            return -EINVAL;
+        }
+    }
+    if (check_geometry(d, &geo) < 0) {
+        return -EINVAL;
+    }
+    if (d->use_mmap && d->use_direct) {
+        user_panic("DDRIVER_MMAP and DDRIVER_DIRECT can't be used together");
+        return -EINVAL;
+    }
+    if (d->use_mmap && d->member_spec[0] != '\0') {
+        user_panic("DDRIVER_MMAP and DDRIVER_MEMBERS can't be used together");
+        return -EINVAL;
+    }
+    if (d->lat_sigma_pm > MAX_LAT_SIGMA_PM || d->stall_ppm > PPM || d->eio_ppm > PPM) {
+        user_panic("sigma should be at most %d, probabilities at most %d ppm", MAX_LAT_SIGMA_PM, PPM);
+        return -EINVAL;
+    }
+    d->next_gc_us = d->gc_period_us;
+    set_geometry(d, &geo);
+    return 0;
+}
+/**
+ * @brief 设备大小为size时每个成员镜像的大小，按整条带向上取整
+ */
+static off_t member_size(struct ddriver *d, off_t size) {
+    off_t row = (off_t)d->stripe_size * d->member_cnt;
+    return (size + row - 1) / row * d->stripe_size;
+}
+/**
+ * @brief 求设备偏移pos所在的成员及成员内偏移
+ * 
+ * @param pos 
+ * @param moff 成员内偏移
+ * @param len 输入为剩余长度，输出截断到条带单元的末尾
+ * @return int 成员下标
+ */
+static int stripe_locate(struct ddriver *d, off_t pos, off_t *moff, size_t *len) {
+    off_t unit   = pos / d->stripe_size;
+    off_t in_su  = pos % d->stripe_size;
+    if (*len > (size_t)(d->stripe_size - in_su)) {
+        *len = d->stripe_size - in_su;
+    }
+    *moff = unit / d->member_cnt * d->stripe_size + in_su;
+    return unit % d->member_cnt;
+}
+/**
+ * @brief 按d->member_spec打开全部成员镜像并扩展到成员大小
+ * 
+ * @return int 第一个成员的fd
+ */
+static int open_members(struct ddriver *d) {
+    char spec[sizeof(d->member_spec)], *path, *save = NULL;
+    int fd, ret;
+
+    strcpy(spec, d->member_spec);
+    d->member_cnt = 0;
+    for (path = strtok_r(spec, ",", &save); path != NULL; path = strtok_r(NULL, ",", &save)) {
+        if (d->member_cnt == MAX_MEMBERS) {
+            user_panic("at most %d members", MAX_MEMBERS);
+            return -EINVAL;
+        }
+        fd = open_image(d, path, O_CREAT | O_RDWR);
+        if (fd < 0) {
+            ret = -errno;
+            user_panic("can't open member [%s]: %s", path, strerror(-ret));
+            return ret;
+        }
+        d->members[d->member_cnt].fd   = fd;
+        d->members[d->member_cnt].head = 0;
+        pthread_mutex_init(&d->members[d->member_cnt].lock, NULL);
+        d->member_cnt++;
+    }
+    if (d->member_cnt == 0) {
+        user_panic("empty member list");
+        return -EINVAL;
+    }
+    for (fd = 0; fd < d->member_cnt; fd++) {
+        ret = grow_image(d->members[fd].fd, member_size(d, d->layout_size));
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return d->members[0].fd;
+}
+/**
+ * @brief 将设备扩展到size，条带时扩展每个成员
+ */
+static int grow_device(struct ddriver *d, off_t size) {
+    int m, ret;
+    if (d->member_cnt == 0) {
+        return grow_image(d->ddriver_fd, size);
+    }
+    for (m = 0; m < d->member_cnt; m++) {
+        ret = grow_image(d->members[m].fd, member_size(d, size));
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 将设备上[offset, offset + len)清零，条带时按条带单元拆到各成员
+ */
+static int zero_device(struct ddriver *d, off_t offset, off_t len) {
+    off_t pos, moff;
+    size_t chunk;
+    int m;
+
+    if (d->member_cnt == 0) {
+        return zero_range(d, d->ddriver_fd, offset, len);
+    }
+    for (pos = offset; pos < offset + len; pos += chunk) {
+        chunk = offset + len - pos;
+        m = stripe_locate(d, pos, &moff, &chunk);
+        if (zero_range(d, d->members[m].fd, moff, chunk) < 0) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 将设备上已完成的写落盘
+ */
+static int sync_device(struct ddriver *d) {
+    int m;
+    if (d->member_cnt == 0) {
+        return fdatasync(d->ddriver_fd);
+    }
+    for (m = 0; m < d->member_cnt; m++) {
+        if (fdatasync(d->members[m].fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 条带设备上的读写，调用者已检查范围
+ * 
+ * 请求在每个成员上落在一段连续区域内。按下标顺序锁住涉及的成员，各成员的寻道
+ * 与读写延迟并行，整个请求的服务时间取其中最大者；不涉及的成员可同时服务其他请求
+ * 
+ * @param op LAT_OP_READ / LAT_OP_WRITE
+ * @return int 读写的字节数
+ */
+static int stripe_rw(struct ddriver *d, char *buf, size_t size, off_t offset, int op) {
+    off_t  start[MAX_MEMBERS], end[MAX_MEMBERS], moff;
+    int    seek[MAX_MEMBERS];
+    int    lat, fail;
+    int    m, us = 0, ret = 0;
+    off_t  pos;
+    size_t chunk;
+
+    pthread_mutex_lock(&d->lock);
+    lat  = lat_sample(d, op == LAT_OP_WRITE ? d->write_lat_us : d->read_lat_us);
+    fail = inject_eio(d);
+    pthread_mutex_unlock(&d->lock);
+    for (m = 0; m < d->member_cnt; m++) {
+        start[m] = -1;
+    }
+    for (pos = offset; pos < offset + (off_t)size; pos += chunk) {
+        chunk = offset + size - pos;
+        m = stripe_locate(d, pos, &moff, &chunk);
+        if (start[m] < 0) {
+            start[m] = moff;
+        }
+        end[m] = moff + chunk;
+    }
+
+    for (m = 0; m < d->member_cnt; m++) {
+        if (start[m] < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&d->members[m].lock);
+        seek[m] = d->members[m].head == start[m] ? -1 :
+                  rotate_us(d, d->members[m].head, start[m], member_size(d, d->layout_size));
+        if ((seek[m] > 0 ? seek[m] : 0) + lat > us) {
+            us = (seek[m] > 0 ? seek[m] : 0) + lat;
+        }
+    }
+    emulate_delay(d, us);
+    for (pos = offset; pos < offset + (off_t)size; pos += chunk) {
+        chunk = offset + size - pos;
+        if (fail) {
+            errno = EIO;
+            ret   = -EIO;
+            break;
+        }
+        m = stripe_locate(d, pos, &moff, &chunk);
+        if (backend_rw(d, d->members[m].fd, buf + (pos - offset), chunk, moff, 
+                       op == LAT_OP_WRITE) != (ssize_t)chunk) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&d->lock);
+    for (m = 0; m < d->member_cnt; m++) {
+        if (start[m] < 0) {
+            continue;
+        }
+        if (seek[m] >= 0) {
+            INC_SEEKCNT(d);
+            d->seek_hist[log2_bucket(llabs(start[m] - d->members[m].head) / d->iounit_size)]++;
+            d->seek_us += seek[m];
+        }
+        d->members[m].head = end[m];
+    }
+    if (ret == 0) {
+        if (op == LAT_OP_WRITE) {
+            INC_WRITECNT(d);
+        }
+        else {
+            INC_READCNT(d);
+        }
+        account_io(d, op, us);
+        d->bytes[op] += size;
+    }
+    else {
+        d->clock_us += us;                            /* 失败的IO同样占用设备 */
+    }
+    pthread_mutex_unlock(&d->lock);
+    for (m = 0; m < d->member_cnt; m++) {
+        if (start[m] >= 0) {
+            pthread_mutex_unlock(&d->members[m].lock);
+        }
+    }
 
-FILE *debugf = NULL;
-/******************************************************************************
-* SECTION: Helper Functions
-*******************************************************************************/
-int check_valid(size_t size) {
-    if (size != CONFIG_BLOCK_SZ){
-        user_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
-        return -EIO;
+    if (ret < 0) {
+        user_panic("%s error: %s", op == LAT_OP_WRITE ? "write" : "read", strerror(errno));
+        return ret;
+    }
+    return size;
+}
+static int disk_rw(struct ddriver *d, char *buf, size_t size, off_t offset, int op);
+static int disk_flush(struct ddriver *d);
+/**
+ * @brief 是否还有序号在seq之前、尚未完成的请求，调用者需持有d->ring.lock
+ */
+static int ring_older_busy(struct ddriver *d, unsigned int seq) {
+    int i;
+    for (i = 0; i < MAX_MEMBERS; i++) {
+        if (d->ring.busy[i] && (int)(d->ring.busy_seq[i] - seq) < 0) {
+            return 1;
+        }
     }
     return 0;
 }
+/**
+ * @brief 工作线程：按提交顺序取出请求执行，结果放入完成环
+ * 
+ * 条带设备上有多个工作线程，请求按提交顺序开始、可乱序完成；FLUSH等序号在它之前的
+ * 请求都完成后才执行，只等更早的请求，多个FLUSH之间不会互相等待
+ */
+static void *ring_worker(void *arg) {
+    struct ddriver *d = (struct ddriver *)arg;
+    struct ddriver_sqe sqe;
+    struct ddriver_cqe cqe;
+    unsigned int seq;
+    int slot;
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
-    int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
-    
-    if (distance == 0) {
+    pthread_mutex_lock(&d->ring.lock);
+    while (1) {
+        while (d->ring.sq_head == d->ring.sq_tail && !d->ring.stop) {
+            pthread_cond_wait(&d->ring.sq_cond, &d->ring.lock);
+        }
+        if (d->ring.sq_head == d->ring.sq_tail) {
+            break;
+        }
+        seq = d->ring.sq_head++;
+        sqe = d->ring.sq[seq % d->ring.depth];
+        for (slot = 0; d->ring.busy[slot]; slot++)   /* 每个工作线程至多占一个槽位，总有空的 */
+            ;
+        d->ring.busy[slot]     = 1;
+        d->ring.busy_seq[slot] = seq;
+        while (sqe.op == DDRIVER_OP_FLUSH && ring_older_busy(d, seq)) {
+            pthread_cond_wait(&d->ring.cq_cond, &d->ring.lock);
+        }
+        pthread_mutex_unlock(&d->ring.lock);
+
+        switch (sqe.op)
+        {
+        case DDRIVER_OP_READ:
+            cqe.res = disk_rw(d, sqe.buf, sqe.size, sqe.offset, LAT_OP_READ);
+            break;
+        case DDRIVER_OP_WRITE:
+            cqe.res = disk_rw(d, sqe.buf, sqe.size, sqe.offset, LAT_OP_WRITE);
+            break;
+        case DDRIVER_OP_FLUSH:
+            cqe.res = disk_flush(d);
+            break;
+        default:
+            cqe.res = -EINVAL;
+            break;
+        }
+        cqe.user_data = sqe.user_data;
+        inflight_dec(d);
+
+        pthread_mutex_lock(&d->ring.lock);
+        d->ring.cq[d->ring.cq_tail % d->ring.depth] = cqe;
+        d->ring.cq_tail++;
+        d->ring.busy[slot] = 0;
+        pthread_cond_broadcast(&d->ring.cq_cond);
+    }
+    pthread_mutex_unlock(&d->ring.lock);
+    return NULL;
+}
+/**
+ * @brief 按d->queue_depth建立环并启动工作线程，调用者需持有d->ring.lock
+ */
+static int ring_start(struct ddriver *d) {
+    int i;
+
+    if (d->ring.running) {
         return 0;
     }
+    d->ring.depth   = d->queue_depth;
+    d->ring.sq      = (struct ddriver_sqe *)calloc(d->ring.depth, sizeof(struct ddriver_sqe));
+    d->ring.cq      = (struct ddriver_cqe *)calloc(d->ring.depth, sizeof(struct ddriver_cqe));
+    d->ring.sq_head = d->ring.sq_tail = 0;
+    d->ring.cq_head = d->ring.cq_tail = 0;
+    d->ring.pending = 0;
+    memset(d->ring.busy, 0, sizeof(d->ring.busy));
+    d->ring.stop    = 0;
+    d->ring.nworkers = 0;
+    for (i = 0; d->ring.sq != NULL && d->ring.cq != NULL && 
+                i < (d->member_cnt > 0 ? d->member_cnt : 1); i++) {
+        if (pthread_create(&d->ring.workers[i], NULL, ring_worker, d) != 0) {
+            break;
+        }
+        d->ring.nworkers++;
+    }
+    if (d->ring.nworkers == 0) {
+        free(d->ring.sq);
+        free(d->ring.cq);
+        d->ring.sq = NULL;
+        d->ring.cq = NULL;
+        return -ENOMEM;
+    }
+    d->ring.running = 1;
+    return 0;
+}
+/**
+ * @brief 执行完已提交的请求后停止工作线程，未被reap的完成项丢弃
+ */
+static void ring_stop(struct ddriver *d) {
+    int i;
+
+    pthread_mutex_lock(&d->ring.lock);
+    if (!d->ring.running) {
+        pthread_mutex_unlock(&d->ring.lock);
+        return;
+    }
+    d->ring.stop = 1;
+    pthread_cond_broadcast(&d->ring.sq_cond);
+    pthread_mutex_unlock(&d->ring.lock);
+    for (i = 0; i < d->ring.nworkers; i++) {
+        pthread_join(d->ring.workers[i], NULL);
+    }
+
+    pthread_mutex_lock(&d->ring.lock);
+    free(d->ring.sq);
+    free(d->ring.cq);
+    d->ring.sq      = NULL;
+    d->ring.cq      = NULL;
+    d->ring.running = 0;
+    pthread_mutex_unlock(&d->ring.lock);
+}
+/**
+ * @brief 按d->trace_path建立轨迹文件并写入文件头
+ */
+static int trace_open(struct ddriver *d) {
+    struct ddriver_trace_hdr hdr;
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+    clock_gettime(CLOCK_MONOTONIC, &d->trace_start);
+    if (d->trace_path[0] == '\0') {
+        return 0;
+    }
+    d->trace = fopen(d->trace_path, "w");
+    if (d->trace == NULL) {
+        return -errno;
+    }
+    hdr.magic       = DDRIVER_TRACE_MAGIC;
+    hdr.version     = DDRIVER_TRACE_VERSION;
+    hdr.iounit_size = d->iounit_size;
+    hdr.rec_size    = sizeof(struct ddriver_trace_rec);
+    hdr.disk_size   = d->layout_size;
+    if (fwrite(&hdr, sizeof(hdr), 1, d->trace) != 1) {
+        fclose(d->trace);
+        d->trace = NULL;
+        return -EIO;
+    }
     return 0;
 }
+/**
+ * @brief 记录一次下发到设备的IO，在开始服务前调用
+ * 
+ * @param op DDRIVER_OP_*
+ */
+static void trace_io(struct ddriver *d, int op, off_t offset, size_t size) {
+    struct ddriver_trace_rec rec;
+    struct timespec now;
+
+    if (d->trace == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec.ts_us  = (now.tv_sec - d->trace_start.tv_sec) * 1000000LL + 
+                 (now.tv_nsec - d->trace_start.tv_nsec) / 1000;
+    rec.offset = offset;
+    rec.size   = size;
+    rec.op     = op;
+    pthread_mutex_lock(&d->trace_lock);
+    fwrite(&rec, sizeof(rec), 1, d->trace);
+    pthread_mutex_unlock(&d->trace_lock);
+}
+/**
+ * @brief 按fd查找已打开的实例
+ * 
+ * @param fd 
+ * @return struct ddriver* 未打开时返回NULL
+ */
+static struct ddriver *get_disk(int fd) {
+    struct ddriver *d = NULL;
+    int i;
+
+    pthread_mutex_lock(&disks_lock);
+    for (i = 0; i < MAX_DISKS; i++) {
+        if (disks[i] != NULL && disks[i]->ddriver_fd == fd) {
+            d = disks[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&disks_lock);
+    return d;
+}
+/**
+ * @brief 新建一个取默认参数的实例
+ */
+static struct ddriver *disk_alloc(const char *path) {
+    struct ddriver *d = (struct ddriver *)malloc(sizeof(struct ddriver));
+    if (d == NULL) {
+        return NULL;
+    }
+    memcpy(d, &disk_default, sizeof(struct ddriver));
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    d->ddriver_fd = -1;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_mutex_init(&d->trace_lock, NULL);
+    pthread_mutex_init(&d->ring.lock, NULL);
+    pthread_cond_init(&d->ring.sq_cond, NULL);
+    pthread_cond_init(&d->ring.cq_cond, NULL);
+    return d;
+}
+/**
+ * @brief 释放实例，调用者需已关闭其镜像和日志
+ */
+static void disk_free(struct ddriver *d) {
+    pthread_cond_destroy(&d->ring.cq_cond);
+    pthread_cond_destroy(&d->ring.sq_cond);
+    pthread_mutex_destroy(&d->ring.lock);
+    pthread_mutex_destroy(&d->trace_lock);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+/**
+ * @brief 关闭实例的镜像、成员和轨迹，不处理日志
+ */
+static void disk_release(struct ddriver *d) {
+    int m;
+
+    if (d->trace != NULL) {
+        fclose(d->trace);
+        d->trace = NULL;
+    }
+    if (d->map != NULL) {
+        msync(d->map, d->map_size, MS_SYNC);
+        munmap(d->map, d->map_size);
+        d->map = NULL;
+    }
+    for (m = 0; m < d->member_cnt; m++) {
+        if (d->members[m].fd != d->ddriver_fd) {
+            close(d->members[m].fd);
+        }
+        pthread_mutex_destroy(&d->members[m].lock);
+    }
+    d->member_cnt = 0;
+    if (d->ddriver_fd >= 0) {
+        close(d->ddriver_fd);
+        d->ddriver_fd = -1;
+    }
+}
 /******************************************************************************
 * SECTION: Global Function Implementation
 *******************************************************************************/
 /**
- * @brief 打开驱动
+ * @brief 打开驱动，可同时打开多个实例
  * 
- * @return int 文件描述符
+ * path为镜像路径，不存在时创建；实例的配置文件和日志分别为path加_conf和_log后缀，
+ * 配置后再由同名环境变量覆盖。配置了DDRIVER_MEMBERS时，设备由这些成员镜像按
+ * DDRIVER_STRIPE_SZ条带组成（RAID-0），path只用来定位配置文件和日志，返回第一个成员的fd
+ * 
+ * @return int 文件描述符，即实例的句柄
  */
 int ddriver_open(char *path) {
-    int fd, ret = 0;
-    char device_path[128] = {0};
-    char log_path[128] = {0};
-    
-    sprintf(device_path, "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
-    sprintf(log_path, "%s/" DEVICE_LOG, getpwuid(getuid())->pw_dir);
+    struct ddriver *d;
+    int fd, i, ret = 0;
+    char log_path[PATH_MAX + 8] = {0};
+    char conf_path[PATH_MAX + 8] = {0};
     
-    if (strcmp(device_path, path) != 0) {
-        user_panic("wrong path [%s], should be [%s]", path, device_path);
-        return -1;
+    if (path == NULL || strlen(path) >= PATH_MAX) {
+        user_panic("bad device path");
+        return -EINVAL;
+    }
+    sprintf(log_path, "%s" DEVICE_LOG, path);
+    sprintf(conf_path, "%s" DEVICE_CONF, path);
+
+    d = disk_alloc(path);
+    if (d == NULL) {
+        return -ENOMEM;
+    }
+    if (load_config(d, conf_path) < 0) {
+        user_panic("bad device config");
+        disk_free(d);
+        return -EINVAL;
     }
 
-    if (access(device_path, F_OK) == 0) {
-        fd = open(device_path, O_RDWR);
+    if (d->member_spec[0] != '\0') {
+        fd = open_members(d);
+    }
+    else if (access(path, F_OK) == 0) {
+        fd = open_image(d, path, O_RDWR);
     }
     else {
-        fd = open(device_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        fd = open_image(d, path, O_CREAT | O_TRUNC | O_RDWR);
     }
     if (fd < 0) {
-        user_panic("can't open device: %d", fd);
+        user_panic("can't open device [%s]: %d", path, fd);
+        disk_release(d);
+        disk_free(d);
         return fd;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
-    if (ret < 0) {
-        user_panic("low space");
+    d->ddriver_fd = fd;
+    ret = grow_device(d, d->layout_size);
+    if (ret == 0) {
+        ret = map_image(d, fd);
+    }
+    if (ret != 0) {
+        user_panic("can't resize or map device: %s", strerror(-ret));
+        disk_release(d);
+        disk_free(d);
         return ret;
     }
 
-    debugf = fopen(log_path, "w+");
-    if (debugf == NULL) {
+    d->log = fopen(log_path, "w+");
+    if (d->log == NULL) {
         user_panic("can't init log: %s", log_path);
+        disk_release(d);
+        disk_free(d);
         return -1;
     }
+    ret = trace_open(d);
+    if (ret != 0) {
+        user_panic("can't open trace [%s]: %s", d->trace_path, strerror(-ret));
+        fclose(d->log);
+        disk_release(d);
+        disk_free(d);
+        return ret;
+    }
 
+    d->head       = 0;
+    d->cursor     = 0;
+    pthread_mutex_lock(&disks_lock);
+    for (i = 0; i < MAX_DISKS && disks[i] != NULL; i++);
+    if (i < MAX_DISKS) {
+        disks[i] = d;
+    }
+    pthread_mutex_unlock(&disks_lock);
+    if (i == MAX_DISKS) {
+        user_panic("at most %d devices can be opened", MAX_DISKS);
+        fclose(d->log);
+        disk_release(d);
+        disk_free(d);
+        return -EMFILE;
+    }
     return fd;
 }
 /**
@@ -168,10 +1379,158 @@ int ddriver_open(char *path) {
  * @return int 
  */
 int ddriver_close(int fd) {
-    return close(fd) && fclose(debugf);
+    struct ddriver *d = get_disk(fd);
+    int i, ret;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    pthread_mutex_lock(&disks_lock);
+    for (i = 0; i < MAX_DISKS; i++) {
+        if (disks[i] == d) {
+            disks[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&disks_lock);
+
+    ring_stop(d);
+    disk_release(d);
+    ret = fclose(d->log);
+    disk_free(d);
+    return ret;
+}
+/**
+ * @brief 将磁盘头移动到offset，计入寻道次数和旋转延迟，调用者需持有d->lock
+ * 
+ * @param offset 
+ * @return int 旋转延迟，微秒
+ */
+static int move_head(struct ddriver *d, off_t offset) {
+    int us;
+    INC_SEEKCNT(d);
+    d->seek_hist[log2_bucket(llabs(offset - d->head) / d->iounit_size)]++;
+    us = emulate_rotate(d, d->head, offset);
+    d->seek_us += us;
+    d->head = offset;
+    return us;
+}
+/**
+ * @brief 在offset处读写size字节，计入延迟和统计，不计入在途IO数
+ * 
+ * @param op LAT_OP_READ / LAT_OP_WRITE
+ * @return int 读写的字节数
+ */
+static int disk_rw(struct ddriver *d, char *buf, size_t size, off_t offset, int op) {
+    ssize_t ret = -1;
+    int us = 0, lat;
+    int res = check_valid_range(d, size);
+    if(res < 0)
+        return res;
+    res = check_valid_addr(d, offset, size);
+    if(res < 0)
+        return res;
+    trace_io(d, op == LAT_OP_WRITE ? DDRIVER_OP_WRITE : DDRIVER_OP_READ, offset, size);
+    if (d->member_cnt > 0) {
+        return stripe_rw(d, buf, size, offset, op);
+    }
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head != offset) {
+        us = move_head(d, offset);
+    }
+    lat = lat_sample(d, op == LAT_OP_WRITE ? d->write_lat_us : d->read_lat_us);
+    emulate_delay(d, lat);
+    if (inject_eio(d)) {
+        errno = EIO;
+    }
+    else {
+        ret = backend_rw(d, d->ddriver_fd, buf, size, offset, op == LAT_OP_WRITE);
+    }
+    if (ret == (ssize_t)size) {
+        d->head = offset + size;
+        if (op == LAT_OP_WRITE) {
+            INC_WRITECNT(d);
+        }
+        else {
+            INC_READCNT(d);
+        }
+        account_io(d, op, us + lat);
+        d->bytes[op] += size;
+    }
+    else {
+        d->clock_us += us + lat;                      /* 失败的IO同样占用设备 */
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    if (ret != (ssize_t)size) {
+        user_panic("%s error: %s", op == LAT_OP_WRITE ? "write" : "read", strerror(errno));
+        return -EIO;
+    }
+    return size;
+}
+/**
+ * @brief 在offset处读出size字节，不依赖也不改变fd的读写位置，线程安全
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size IO单位的整数倍
+ * @param offset 与IO单位对齐
+ * @return int 读出的字节数
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset){
+    struct ddriver *d = get_disk(fd);
+    int ret;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    inflight_inc(d);
+    ret = disk_rw(d, buf, size, offset, LAT_OP_READ);
+    inflight_dec(d);
+    return ret;
+}
+/**
+ * @brief 在offset处写入size字节，不依赖也不改变fd的读写位置，线程安全
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size IO单位的整数倍
+ * @param offset 与IO单位对齐
+ * @return int 写入的字节数
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset){
+    struct ddriver *d = get_disk(fd);
+    int ret;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    inflight_inc(d);
+    ret = disk_rw(d, buf, size, offset, LAT_OP_WRITE);
+    inflight_dec(d);
+    return ret;
+}
+/**
+ * @brief 之前完成的写全部落盘后返回
+ * 
+ * @param fd 
+ * @return int 
+ */
+static int disk_flush(struct ddriver *d) {
+    trace_io(d, DDRIVER_OP_FLUSH, 0, 0);
+    pthread_mutex_lock(&d->lock);
+    if ((d->map != NULL && msync(d->map, d->map_size, MS_SYNC) < 0) || 
+        sync_device(d) < 0) {
+        pthread_mutex_unlock(&d->lock);
+        user_panic("flush error: %s", strerror(errno));
+        return -EIO;
+    }
+    d->flush_cnt++;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
 }
 /**
- * @brief 磁盘头SEEK
+ * @brief 磁盘头SEEK，兼容接口，随后的read/write从该位置开始
  * 
  * @param fd 
  * @param offset 
@@ -179,24 +1538,43 @@ int ddriver_close(int fd) {
  * @return int 
  */
 int ddriver_seek(int fd, off_t offset, int whence){
-    int ret = 0;
-    int cur = 0;
+    struct ddriver *d = get_disk(fd);
+    off_t pos;
 
-    if (!IS_ADDR_ALIGN(offset)) {
-        user_alert("offset %ld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+    if (d == NULL) {
+        return -EBADF;
+    }
+    if (!IS_ADDR_ALIGN(d, offset)) {
+        user_alert(d, "offset %ld must be aligned to block size %d", 
+                      offset, d->iounit_size);
         return -EINVAL;
     }
 
-    INC_SEEKCNT(disk);
-    cur = lseek(fd, 0, SEEK_CUR);
-    ret = lseek(fd, offset, whence);
-    if (ret < 0) {
-        user_panic("seek error: %s", strerror(errno));
-        return ret;
+    pthread_mutex_lock(&d->lock);
+    switch (whence)
+    {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = d->cursor + offset;
+        break;
+    case SEEK_END:
+        pos = d->layout_size + offset;
+        break;
+    default:
+        pthread_mutex_unlock(&d->lock);
+        return -EINVAL;
     }
-    emulate_rotate(fd, cur, ret);
-    return ret;
+    if (pos < 0) {
+        pthread_mutex_unlock(&d->lock);
+        user_panic("seek error: %s", strerror(EINVAL));
+        return -EINVAL;
+    }
+    d->clock_us += move_head(d, pos);
+    d->cursor = pos;
+    pthread_mutex_unlock(&d->lock);
+    return pos;
 }
 /**
  * @brief 磁盘写入，写入大小可通过IOCTL查询
@@ -207,15 +1585,20 @@ int ddriver_seek(int fd, off_t offset, int whence){
  * @return int 
  */
 int ddriver_write(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *d = get_disk(fd);
+    int res;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    res = check_valid(d, size);
     if(res < 0)
         return res;
-        
-    RW_DELAY(disk, write);
-    write(fd, buf, size);
 
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    res = ddriver_pwrite(fd, buf, size, d->cursor);
+    if (res > 0)
+        d->cursor += res;
+    return res;
 }
 /**
  * @brief 
@@ -226,15 +1609,200 @@ int ddriver_write(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_read(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *d = get_disk(fd);
+    int res;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    res = check_valid(d, size);
     if(res < 0)
         return res;
 
-    RW_DELAY(disk, read);
-    read(fd, buf, size);
+    res = ddriver_pread(fd, buf, size, d->cursor);
+    if (res > 0)
+        d->cursor += res;
+    return res;
+}
+/**
+ * @brief 连续多块写入，size为IO单位的整数倍，整段只计一次写延迟和一次系统调用
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 
+ * @return int 写入的字节数
+ */
+int ddriver_writev(int fd, char *buf, size_t size){
+    struct ddriver *d = get_disk(fd);
+    int res;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    res = ddriver_pwrite(fd, buf, size, d->cursor);
+    if (res > 0)
+        d->cursor += res;
+    return res;
+}
+/**
+ * @brief 连续多块读出，size为IO单位的整数倍，整段只计一次读延迟和一次系统调用
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 
+ * @return int 读出的字节数
+ */
+int ddriver_readv(int fd, char *buf, size_t size){
+    struct ddriver *d = get_disk(fd);
+    int res;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    res = ddriver_pread(fd, buf, size, d->cursor);
+    if (res > 0)
+        d->cursor += res;
+    return res;
+}
+/**
+ * @brief 异步提交一批请求，由工作线程按提交顺序执行
+ * 
+ * 已提交未被reap的请求数不超过DDRIVER_QUEUE_DEPTH，超出的部分不提交。
+ * 完成环由同一设备上的所有提交者共享，user_data只在一次提交内有意义，多个线程
+ * 同时submit/reap会取走彼此的完成项，调用者需保证同一时刻只有一个提交者在用环
+ * 
+ * @param fd 
+ * @param sqes 
+ * @param cnt 
+ * @return int 实际提交的个数，小于0失败
+ */
+int ddriver_submit(int fd, struct ddriver_sqe *sqes, int cnt) {
+    struct ddriver *d = get_disk(fd);
+    int i, n;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    pthread_mutex_lock(&d->ring.lock);
+    if (ring_start(d) < 0) {
+        pthread_mutex_unlock(&d->ring.lock);
+        return -ENOMEM;
+    }
+    n = d->ring.depth - d->ring.pending;
+    n = n < cnt ? n : cnt;
+    for (i = 0; i < n; i++) {
+        d->ring.sq[d->ring.sq_tail % d->ring.depth] = sqes[i];
+        d->ring.sq_tail++;
+        inflight_inc(d);
+    }
+    d->ring.pending += n;
+    if (n > 0) {
+        pthread_cond_signal(&d->ring.sq_cond);
+    }
+    pthread_mutex_unlock(&d->ring.lock);
+    return n;
+}
+/**
+ * @brief 取回已完成的请求
+ * 
+ * @param fd 
+ * @param cqes 
+ * @param max 最多取回的个数
+ * @param min_complete 至少等到这么多个完成，超过在途请求数时按在途请求数计
+ * @return int 取回的个数
+ */
+int ddriver_reap(int fd, struct ddriver_cqe *cqes, int max, int min_complete) {
+    struct ddriver *d = get_disk(fd);
+    int n = 0;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
+    pthread_mutex_lock(&d->ring.lock);
+    min_complete = min_complete < d->ring.pending ? min_complete : d->ring.pending;
+    min_complete = min_complete < max ? min_complete : max;
+    while ((int)(d->ring.cq_tail - d->ring.cq_head) < min_complete) {
+        pthread_cond_wait(&d->ring.cq_cond, &d->ring.lock);
+    }
+    while (n < max && d->ring.cq_head != d->ring.cq_tail) {
+        cqes[n++] = d->ring.cq[d->ring.cq_head % d->ring.depth];
+        d->ring.cq_head++;
+    }
+    d->ring.pending -= n;
+    pthread_mutex_unlock(&d->ring.lock);
+    return n;
+}
+/**
+ * @brief 取得第blkno个IO单位在镜像映射中的地址，可直接读写，修改需ddriver_msync才保证落盘
+ * 
+ * 只在mmap后端下可用；设置DDRIVER_MAP_ACCOUNT时按一次读计入统计和延迟
+ * 
+ * @param fd 
+ * @param blkno IO单位编号
+ * @return char* 未使用mmap后端或越界时返回NULL
+ */
+char *ddriver_map_block(int fd, unsigned long long blkno) {
+    struct ddriver *d = get_disk(fd);
+    off_t offset;
+    int us = 0, lat;
+
+    if (d == NULL || d->map == NULL) {
+        return NULL;
+    }
+    offset = (off_t)blkno * d->iounit_size;
+    if (offset >= d->layout_size) {
+        return NULL;
+    }
+    if (d->map_account) {
+        trace_io(d, DDRIVER_OP_READ, offset, d->iounit_size);
+        inflight_inc(d);
+        pthread_mutex_lock(&d->lock);
+        if (d->head != offset) {
+            us = move_head(d, offset);
+        }
+        lat = lat_sample(d, d->read_lat_us);
+        emulate_delay(d, lat);
+        d->head = offset + d->iounit_size;
+        INC_READCNT(d);
+        account_io(d, LAT_OP_READ, us + lat);
+        d->bytes[LAT_OP_READ] += d->iounit_size;
+        pthread_mutex_unlock(&d->lock);
+        inflight_dec(d);
+    }
+    return d->map + offset;
+}
+/**
+ * @brief 将映射中[offset, offset + size)的修改同步写回镜像
+ * 
+ * @param fd 
+ * @param offset 与IO单位对齐
+ * @param size 为0时同步整个设备
+ * @return int 
+ */
+int ddriver_msync(int fd, off_t offset, size_t size) {
+    struct ddriver *d = get_disk(fd);
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start;
 
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    if (d == NULL) {
+        return -EBADF;
+    }
+    if (d->map == NULL) {
+        return sync_device(d) < 0 ? -EIO : 0;
+    }
+    if (size == 0) {
+        offset = 0;
+        size   = d->map_size;
+    }
+    if (check_valid_addr(d, offset, size) < 0) {
+        return -EINVAL;
+    }
+    start = offset / page * page;                     /* msync要求页对齐 */
+    if (msync(d->map + start, offset + size - start, MS_SYNC) < 0) {
+        user_panic("msync error: %s", strerror(errno));
+        return -EIO;
+    }
+    return 0;
 }
 /**
  * @brief 
@@ -246,31 +1814,143 @@ int ddriver_read(int fd, char *buf, size_t size){
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
     struct ddriver_state state;
+    struct ddriver_state_ext state_ext;
+    struct ddriver_geometry geo;
+    struct ddriver_stats stats;
+    struct ddriver_discard discard;
+    struct ddriver *d = get_disk(fd);
+    int size;
+
+    if (d == NULL) {
+        return -EBADF;
+    }
     switch (cmd)
     {
-    case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        memcpy(arg, &disk.layout_size, sizeof(int));
+    case IOC_REQ_DEVICE_SIZE:                         /* Device Size, 超过2GB时截断，请用GEOMETRY */
+        size = d->layout_size > INT_MAX ? INT_MAX : (int)d->layout_size;
+        memcpy(arg, &size, sizeof(int));
         break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        pthread_mutex_lock(&d->lock);
+        state.read_cnt = d->read_cnt;
+        state.write_cnt = d->write_cnt;
+        state.seek_cnt = d->seek_cnt;
+        pthread_mutex_unlock(&d->lock);
         memcpy(arg, &state, sizeof(struct ddriver_state));
         break;
+    case IOC_REQ_DEVICE_STATE_EXT:                    /* Device State with modeled latency */
+        pthread_mutex_lock(&d->lock);
+        state_ext.read_cnt     = d->read_cnt;
+        state_ext.write_cnt    = d->write_cnt;
+        state_ext.seek_cnt     = d->seek_cnt;
+        state_ext.virtual_time = d->virtual_time;
+        state_ext.clock_us     = d->clock_us;
+        state_ext.seek_us      = d->seek_us;
+        fill_lat(d, &state_ext.read, LAT_OP_READ, d->read_cnt);
+        fill_lat(d, &state_ext.write, LAT_OP_WRITE, d->write_cnt);
+        pthread_mutex_unlock(&d->lock);
+        memcpy(arg, &state_ext, sizeof(struct ddriver_state_ext));
+        break;
+    case IOC_REQ_DEVICE_STATS:                        /* Versioned Stats, 只填充调用者给出的size */
+        memcpy(&size, &((struct ddriver_stats *)arg)->size, sizeof(int));
+        if (size < (int)(2 * sizeof(unsigned int))) {
+            return -EINVAL;
+        }
+        memset(&stats, 0, sizeof(struct ddriver_stats));
+        pthread_mutex_lock(&d->lock);
+        stats.version         = DDRIVER_STATS_VERSION;
+        stats.size            = size < (int)sizeof(struct ddriver_stats) ? 
+                                size : (int)sizeof(struct ddriver_stats);
+        stats.read_cnt        = d->read_cnt;
+        stats.write_cnt       = d->write_cnt;
+        stats.seek_cnt        = d->seek_cnt;
+        stats.read_bytes      = d->bytes[LAT_OP_READ];
+        stats.write_bytes     = d->bytes[LAT_OP_WRITE];
+        stats.clock_us        = d->clock_us;
+        stats.seek_us         = d->seek_us;
+        stats.queue_depth_hwm = d->inflight_hwm;
+        fill_lat_log2(d, stats.read_lat_hist, LAT_OP_READ);
+        fill_lat_log2(d, stats.write_lat_hist, LAT_OP_WRITE);
+        memcpy(stats.seek_dist_hist, d->seek_hist, sizeof(d->seek_hist));
+        stats.discard_cnt     = d->discard_cnt;
+        stats.discard_bytes   = d->discard_bytes;
+        stats.flush_cnt       = d->flush_cnt;
+        stats.read_p999_us    = lat_percentile(d, LAT_OP_READ, d->read_cnt, 999);
+        stats.write_p999_us   = lat_percentile(d, LAT_OP_WRITE, d->write_cnt, 999);
+        stats.stall_cnt       = d->stall_cnt;
+        stats.eio_cnt         = d->eio_cnt;
+        pthread_mutex_unlock(&d->lock);
+        memcpy(arg, &stats, stats.size);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* 丢弃一段数据，之后读出为0 */
+        memcpy(&discard, arg, sizeof(struct ddriver_discard));
+        if (discard.len == 0 || !IS_ADDR_ALIGN(d, discard.offset) || !IS_ADDR_ALIGN(d, discard.len) ||
+            discard.offset + discard.len > (unsigned long long)d->layout_size) {
+            user_alert(d, "bad discard range [%llu, +%llu)", discard.offset, discard.len);
+            return -EINVAL;
+        }
+        trace_io(d, DDRIVER_OP_DISCARD, discard.offset, discard.len);
+        pthread_mutex_lock(&d->lock);
+        if (zero_device(d, discard.offset, discard.len) < 0) {
+            pthread_mutex_unlock(&d->lock);
+            user_panic("discard error: %s", strerror(errno));
+            return -EIO;
+        }
+        d->discard_cnt++;
+        d->discard_bytes += discard.len;
+        pthread_mutex_unlock(&d->lock);
+        break;
+    case IOC_REQ_DEVICE_FLUSH:                        /* 屏障：之前完成的写全部落盘后返回 */
+        return disk_flush(d);
+    case IOC_REQ_DEVICE_RESET_STATS:                  /* 只清零统计，不擦除磁盘 */
+        pthread_mutex_lock(&d->lock);
+        reset_stats(d);
+        pthread_mutex_unlock(&d->lock);
+        break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
+        pthread_mutex_lock(&d->lock);
+        if (zero_device(d, 0, d->layout_size) < 0) {
+            pthread_mutex_unlock(&d->lock);
+            user_panic("reset error: %s", strerror(errno));
+            return -EIO;
         }
-        lseek(fd, 0, SEEK_SET);
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        for (size = 0; size < d->member_cnt; size++) {
+            d->members[size].head = 0;
+        }
+        d->head = 0;
+        d->cursor = 0;
+        reset_stats(d);
+        pthread_mutex_unlock(&d->lock);
         break;
     case IOC_REQ_DEVICE_IO_SZ:
-        memcpy(arg, &disk.iounit_size, sizeof(int));
+        memcpy(arg, &d->iounit_size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_GEOMETRY:                     /* Device Geometry & Latency Model */
+        pthread_mutex_lock(&d->lock);
+        get_geometry(d, &geo);
+        pthread_mutex_unlock(&d->lock);
+        memcpy(arg, &geo, sizeof(struct ddriver_geometry));
+        break;
+    case IOC_REQ_DEVICE_SET_GEOMETRY:                 /* 修改几何参数，设备只会变大 */
+        memcpy(&geo, arg, sizeof(struct ddriver_geometry));
+        if (check_geometry(d, &geo) < 0) {
+            return -EINVAL;
+        }
+        pthread_mutex_lock(&d->lock);
+        if (grow_device(d, geo.disk_size) != 0) {
+            pthread_mutex_unlock(&d->lock);
+            user_panic("can't resize device");
+            return -ENOSPC;
+        }
+        set_geometry(d, &geo);
+        if (map_image(d, fd) != 0) {                     /* 映射随设备大小重建，旧的块地址失效 */
+            pthread_mutex_unlock(&d->lock);
+            user_panic("can't map device");
+            return -ENOMEM;
+        }
+        d->head   = ADDR_ROUND_UP(d, d->head);
+        d->cursor = ADDR_ROUND_UP(d, d->cursor);
+        pthread_mutex_unlock(&d->lock);
         break;
     default:
         break;
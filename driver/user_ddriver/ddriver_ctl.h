@@ -14,8 +14,127 @@ struct ddriver_state
     int seek_cnt;
 };
 
+struct ddriver_geometry
+{
+    unsigned long long disk_size;                   /* 设备大小，字节 */
+    int iounit_size;                                /* IO单位，字节 */
+    int track_num;
+    int read_lat_us;
+    int write_lat_us;
+    int seek_lat_us;                                /* 转过一整个磁道的延迟 */
+    int virtual_time;                               /* 非0时只累计模型时间，不真正睡眠 */
+};
+
+struct ddriver_lat
+{
+    unsigned long long cnt;
+    unsigned long long total_us;                    /* 模型服务时间之和，含寻道 */
+    unsigned long long p50_us;
+    unsigned long long p90_us;
+    unsigned long long p99_us;
+    unsigned long long max_us;
+};
+
+struct ddriver_state_ext
+{
+    int write_cnt;
+    int read_cnt;
+    int seek_cnt;
+    int virtual_time;
+    unsigned long long clock_us;                    /* 模型时钟 */
+    unsigned long long seek_us;                     /* 其中寻道与旋转的部分 */
+    struct ddriver_lat read;
+    struct ddriver_lat write;
+};
+
+#define DDRIVER_STATS_VERSION   4
+#define DDRIVER_HIST_BUCKETS    40                  /* 第0桶为0，第i桶为[2^(i-1), 2^i) */
+/* 调用前置size为调用者所知的结构大小，驱动只填充前size字节并回写version和实际size，
+ * 新版本只在末尾追加字段 */
+struct ddriver_stats
+{
+    unsigned int version;
+    unsigned int size;
+    int read_cnt;
+    int write_cnt;
+    int seek_cnt;
+    int queue_depth_hwm;                            /* 同时在途IO数的最大值 */
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+    unsigned long long clock_us;                    /* 模型时钟 */
+    unsigned long long seek_us;
+    unsigned long long read_lat_hist[DDRIVER_HIST_BUCKETS];   /* 单位us */
+    unsigned long long write_lat_hist[DDRIVER_HIST_BUCKETS];
+    unsigned long long seek_dist_hist[DDRIVER_HIST_BUCKETS];  /* 单位为IO单位 */
+    /* version 2 */
+    unsigned long long discard_cnt;
+    unsigned long long discard_bytes;
+    /* version 3 */
+    unsigned long long flush_cnt;
+    /* version 4 */
+    unsigned long long read_p999_us;                /* 由驱动内的细分直方图求得 */
+    unsigned long long write_p999_us;
+    unsigned long long stall_cnt;                   /* 遇到延迟分布中停顿的IO数 */
+    unsigned long long eio_cnt;                     /* 注入的EIO数 */
+};
+
+struct ddriver_discard
+{
+    unsigned long long offset;                      /* 与IO单位对齐 */
+    unsigned long long len;                         /* IO单位的整数倍 */
+};
+
+/* 异步接口 ddriver_submit / ddriver_reap 的请求与完成项 */
+#define DDRIVER_OP_READ         0
+#define DDRIVER_OP_WRITE        1
+#define DDRIVER_OP_FLUSH        2                   /* 之前提交的写全部落盘后完成 */
+
+struct ddriver_sqe
+{
+    int op;
+    unsigned int size;                              /* IO单位的整数倍 */
+    char *buf;
+    unsigned long long offset;                      /* 与IO单位对齐 */
+    unsigned long long user_data;                   /* 原样带回到完成项 */
+};
+
+struct ddriver_cqe
+{
+    unsigned long long user_data;
+    int res;                                        /* 读写的字节数，小于0失败 */
+};
+
+/* DDRIVER_TRACE=<文件> 时记录的块IO轨迹：一个文件头后跟若干定长记录，均为本机字节序 */
+#define DDRIVER_TRACE_MAGIC     0x52544444          /* "DDTR" */
+#define DDRIVER_TRACE_VERSION   1
+#define DDRIVER_OP_DISCARD      3                   /* 仅出现在轨迹中 */
+
+struct ddriver_trace_hdr
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int iounit_size;
+    unsigned int rec_size;                          /* sizeof(struct ddriver_trace_rec) */
+    unsigned long long disk_size;
+};
+
+struct ddriver_trace_rec
+{
+    unsigned long long ts_us;                       /* 距打开设备的时间，微秒 */
+    unsigned long long offset;
+    unsigned int size;
+    unsigned int op;                                /* DDRIVER_OP_* */
+};
+
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)
+#define IOC_REQ_DEVICE_GEOMETRY     _IOR(IOC_MAGIC, 4, struct ddriver_geometry)
+#define IOC_REQ_DEVICE_SET_GEOMETRY _IOW(IOC_MAGIC, 5, struct ddriver_geometry)
+#define IOC_REQ_DEVICE_STATE_EXT    _IOR(IOC_MAGIC, 6, struct ddriver_state_ext)
+#define IOC_REQ_DEVICE_RESET_STATS  _IO(IOC_MAGIC, 7)
+#define IOC_REQ_DEVICE_STATS        _IOWR(IOC_MAGIC, 8, struct ddriver_stats)
+#define IOC_REQ_DEVICE_DISCARD      _IOW(IOC_MAGIC, 9, struct ddriver_discard)
+#define IOC_REQ_DEVICE_FLUSH        _IO(IOC_MAGIC, 10)
 #endif
\ No newline at end of file
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include <unistd.h>
+#include <time.h>
+#include "errno.h"
+#include "ddriver.h"
+
+/******************************************************************************
+* SECTION: ddriver-replay
+*
+* 把ddriver记录的块IO轨迹（DDRIVER_TRACE）重新下发到一个镜像上，用于在不同的
+* 延迟模型和下发方式下比较同一段IO流。写入的数据不在轨迹中，以固定花样填充。
+*******************************************************************************/
+#define REPLAY_MODE_SYNC    0                         /* 按轨迹顺序逐个同步下发 */
+#define REPLAY_MODE_ASYNC   1                         /* 按轨迹顺序异步下发 */
+#define REPLAY_MODE_CLOOK   2                         /* 每批按C-LOOK排序后异步下发 */
+#define REPLAY_ALIGN        4096
+
+struct replay_options {
+    int       mode;
+    int       depth;                                  /* 异步时的在途数/批大小 */
+    int       timed;                                  /* 非0时按轨迹中的时间间隔下发 */
+    int       virtual_time;
+    int       read_lat_us;                            /* 小于0表示沿用镜像的配置 */
+    int       write_lat_us;
+    int       seek_lat_us;
+};
+
+static struct ddriver_trace_rec* recs;
+static long                      rec_cnt;
+static unsigned int              max_size;
+static struct timespec           replay_start;
+
+static void usage() {
+    printf("usage: ddriver-replay [-m sync|async|clook] [-q depth] [-T] [-v] "
+           "[-r us] [-w us] [-s us] <trace> <image>\n");
+    printf("  -m sync   按轨迹顺序逐个同步下发（默认）\n");
+    printf("     async  按轨迹顺序经ddriver_submit下发，最多depth个在途\n");
+    printf("     clook  每depth个请求为一批，按C-LOOK排序后异步下发\n");
+    printf("  -q depth  异步下发的在途数/批大小，默认32\n");
+    printf("  -T        按轨迹中的时间间隔下发，默认尽快下发\n");
+    printf("  -v        虚拟时间，只累计模型延迟\n");
+    printf("  -r/-w/-s  覆盖读/写/旋转延迟，微秒\n");
+}
+/**
+ * @brief 读入整个轨迹文件
+ */
+static int load_trace(const char* path, struct ddriver_trace_hdr* hdr) {
+    FILE* f = fopen(path, "r");
+    long  cap = 1024;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != DDRIVER_TRACE_MAGIC ||
+        hdr->version != DDRIVER_TRACE_VERSION || hdr->rec_size != sizeof(struct ddriver_trace_rec)) {
+        fprintf(stderr, "%s: not a ddriver trace\n", path);
+        fclose(f);
+        return -1;
+    }
+    recs = (struct ddriver_trace_rec*)malloc(cap * sizeof(struct ddriver_trace_rec));
+    while (recs != NULL && fread(&recs[rec_cnt], sizeof(struct ddriver_trace_rec), 1, f) == 1) {
+        if (recs[rec_cnt].size > max_size) {
+            max_size = recs[rec_cnt].size;
+        }
+        if (++rec_cnt == cap) {
+            cap *= 2;
+            recs = (struct ddriver_trace_rec*)realloc(recs, cap * sizeof(struct ddriver_trace_rec));
+        }
+    }
+    fclose(f);
+    return recs == NULL ? -1 : 0;
+}
+/**
+ * @brief 按轨迹时间下发时，等到rec的时间点
+ */
+static void wait_until(struct replay_options* opt, struct ddriver_trace_rec* rec) {
+    struct timespec now;
+    long long       elapsed;
+
+    if (!opt->timed) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - replay_start.tv_sec) * 1000000LL +
+              (now.tv_nsec - replay_start.tv_nsec) / 1000;
+    if ((long long)rec->ts_us > elapsed) {
+        usleep(rec->ts_us - elapsed);
+    }
+}
+/**
+ * @brief 同步下发一条记录
+ */
+static int issue_sync(int fd, struct ddriver_trace_rec* rec, char* buf) {
+    struct ddriver_discard discard;
+
+    switch (rec->op)
+    {
+    case DDRIVER_OP_READ:
+        return ddriver_pread(fd, buf, rec->size, rec->offset) == (int)rec->size ? 0 : -EIO;
+    case DDRIVER_OP_WRITE:
+        return ddriver_pwrite(fd, buf, rec->size, rec->offset) == (int)rec->size ? 0 : -EIO;
+    case DDRIVER_OP_FLUSH:
+        return ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH, NULL);
+    case DDRIVER_OP_DISCARD:
+        discard.offset = rec->offset;
+        discard.len    = rec->size;
+        return ddriver_ioctl(fd, IOC_REQ_DEVICE_DISCARD, &discard);
+    default:
+        return -EINVAL;
+    }
+}
+/**
+ * @brief 取回所有在途请求，归还其Buf槽位
+ */
+static int drain(int fd, int* free_slots, int* free_cnt, int inflight) {
+    struct ddriver_cqe cqe[64];
+    int i, n, err = 0;
+
+    while (inflight > 0) {
+        n = ddriver_reap(fd, cqe, 64, 1);
+        for (i = 0; i < n; i++) {
+            free_slots[(*free_cnt)++] = cqe[i].user_data;
+            err |= cqe[i].res < 0;
+        }
+        inflight -= n;
+    }
+    return err ? -EIO : 0;
+}
+
+static long long clook_head;
+
+static int clook_cmp(const void* a, const void* b) {
+    const struct ddriver_trace_rec* ra = (const struct ddriver_trace_rec*)a;
+    const struct ddriver_trace_rec* rb = (const struct ddriver_trace_rec*)b;
+    int wa = (long long)ra->offset < clook_head;      /* 磁头之前的排到下一轮 */
+    int wb = (long long)rb->offset < clook_head;
+    if (wa != wb) {
+        return wa - wb;
+    }
+    return ra->offset < rb->offset ? -1 : (ra->offset > rb->offset);
+}
+/**
+ * @brief 异步下发：读写经环下发，FLUSH和DISCARD前先取回所有在途请求
+ */
+static int replay_async(int fd, struct replay_options* opt, char** bufs) {
+    struct ddriver_sqe sqe;
+    struct ddriver_cqe cqe[64];
+    int*  free_slots = (int*)malloc(opt->depth * sizeof(int));
+    int   free_cnt = 0, inflight = 0, err = 0;
+    long  i, j, end;
+
+    for (i = 0; i < opt->depth; i++) {
+        free_slots[free_cnt++] = i;
+    }
+    for (i = 0; i < rec_cnt; i = end) {
+        end = i + 1;
+        if (recs[i].op != DDRIVER_OP_READ && recs[i].op != DDRIVER_OP_WRITE) {
+            err |= drain(fd, free_slots, &free_cnt, inflight);
+            inflight = 0;
+            wait_until(opt, &recs[i]);
+            err |= issue_sync(fd, &recs[i], bufs[0]);
+            continue;
+        }
+        if (opt->mode == REPLAY_MODE_CLOOK) {         /* 一批连续的读写按C-LOOK重排 */
+            while (end < rec_cnt && end - i < opt->depth &&
+                   (recs[end].op == DDRIVER_OP_READ || recs[end].op == DDRIVER_OP_WRITE)) {
+                end++;
+            }
+            qsort(&recs[i], end - i, sizeof(struct ddriver_trace_rec), clook_cmp);
+            clook_head = recs[end - 1].offset + recs[end - 1].size;
+        }
+        for (j = i; j < end; j++) {
+            while (free_cnt == 0) {
+                int k, n = ddriver_reap(fd, cqe, 64, 1);
+                for (k = 0; k < n; k++) {
+                    free_slots[free_cnt++] = cqe[k].user_data;
+                    err |= cqe[k].res < 0;
+                }
+                inflight -= n;
+            }
+            wait_until(opt, &recs[j]);
+            sqe.op        = recs[j].op;
+            sqe.size      = recs[j].size;
+            sqe.offset    = recs[j].offset;
+            sqe.user_data = free_slots[--free_cnt];
+            sqe.buf       = bufs[sqe.user_data];
+            if (ddriver_submit(fd, &sqe, 1) != 1) {
+                free(free_slots);
+                return -EIO;
+            }
+            inflight++;
+        }
+    }
+    err |= drain(fd, free_slots, &free_cnt, inflight);
+    free(free_slots);
+    return err ? -EIO : 0;
+}
+/**
+ * @brief 打印设备统计
+ */
+static void report(int fd, double wall_ms) {
+    struct ddriver_state_ext st;
+    struct ddriver_stats     stats;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.size = sizeof(stats);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATE_EXT, &st);
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS, &stats);
+    printf("records     %ld\n", rec_cnt);
+    printf("wall time   %.1f ms\n", wall_ms);
+    printf("device      read %d (%llu bytes), write %d (%llu bytes), seek %d\n",
+           st.read_cnt, stats.read_bytes, st.write_cnt, stats.write_bytes, st.seek_cnt);
+    printf("modeled     %llu us (seek %llu us), queue depth hwm %d\n",
+           st.clock_us, st.seek_us, stats.queue_depth_hwm);
+    printf("read  lat   p50/p90/p99/p999/max %llu/%llu/%llu/%llu/%llu us\n",
+           st.read.p50_us, st.read.p90_us, st.read.p99_us, stats.read_p999_us, st.read.max_us);
+    printf("write lat   p50/p90/p99/p999/max %llu/%llu/%llu/%llu/%llu us\n",
+           st.write.p50_us, st.write.p90_us, st.write.p99_us, stats.write_p999_us, st.write.max_us);
+    printf("discard     %llu bytes, flush %llu\n", stats.discard_bytes, stats.flush_cnt);
+    printf("injected    %llu stalls, %llu EIO\n", stats.stall_cnt, stats.eio_cnt);
+}
+
+int main(int argc, char** argv) {
+    struct replay_options   opt = { REPLAY_MODE_SYNC, 32, 0, 0, -1, -1, -1 };
+    struct ddriver_trace_hdr hdr;
+    struct ddriver_geometry  geo;
+    struct timespec          end;
+    char** bufs;
+    int    c, fd, i, nbufs, ret = 0;
+    long   r;
+
+    while ((c = getopt(argc, argv, "m:q:Tvr:w:s:h")) != -1) {
+        switch (c)
+        {
+        case 'm':
+            if      (strcmp(optarg, "sync") == 0)  opt.mode = REPLAY_MODE_SYNC;
+            else if (strcmp(optarg, "async") == 0) opt.mode = REPLAY_MODE_ASYNC;
+            else if (strcmp(optarg, "clook") == 0) opt.mode = REPLAY_MODE_CLOOK;
+            else { usage(); return 1; }
+            break;
+        case 'q': opt.depth        = atoi(optarg); break;
+        case 'T': opt.timed        = 1;            break;
+        case 'v': opt.virtual_time = 1;            break;
+        case 'r': opt.read_lat_us  = atoi(optarg); break;
+        case 'w': opt.write_lat_us = atoi(optarg); break;
+        case 's': opt.seek_lat_us  = atoi(optarg); break;
+        default:  usage(); return c == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 2 || opt.depth <= 0) {
+        usage();
+        return 1;
+    }
+    if (load_trace(argv[optind], &hdr) < 0) {
+        return 1;
+    }
+
+    fd = ddriver_open(argv[optind + 1]);
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s\n", argv[optind + 1]);
+        return 1;
+    }
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_GEOMETRY, &geo);  /* 几何参数与录制时一致，延迟模型可覆盖 */
+    geo.iounit_size = hdr.iounit_size;
+    if (geo.disk_size < hdr.disk_size) {
+        geo.disk_size = hdr.disk_size;
+    }
+    if (opt.read_lat_us >= 0)  geo.read_lat_us  = opt.read_lat_us;
+    if (opt.write_lat_us >= 0) geo.write_lat_us = opt.write_lat_us;
+    if (opt.seek_lat_us >= 0)  geo.seek_lat_us  = opt.seek_lat_us;
+    if (opt.virtual_time)      geo.virtual_time = 1;
+    if (ddriver_ioctl(fd, IOC_REQ_DEVICE_SET_GEOMETRY, &geo) != 0) {
+        fprintf(stderr, "can't set geometry\n");
+        ddriver_close(fd);
+        return 1;
+    }
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_RESET_STATS, NULL);
+
+    nbufs = opt.mode == REPLAY_MODE_SYNC ? 1 : opt.depth;
+    bufs  = (char**)malloc(nbufs * sizeof(char*));
+    for (i = 0; i < nbufs; i++) {
+        if (posix_memalign((void**)&bufs[i], REPLAY_ALIGN, max_size ? max_size : REPLAY_ALIGN) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        memset(bufs[i], 0x5a, max_size);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+    if (opt.mode == REPLAY_MODE_SYNC) {
+        for (r = 0; r < rec_cnt && ret == 0; r++) {
+            wait_until(&opt, &recs[r]);
+            ret = issue_sync(fd, &recs[r], bufs[0]);
+        }
+    }
+    else {
+        ret = replay_async(fd, &opt, bufs);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ret != 0) {
+        fprintf(stderr, "replay failed: %s\n", strerror(-ret));
+    }
+
+    report(fd, (end.tv_sec - replay_start.tv_sec) * 1000.0 +
+               (end.tv_nsec - replay_start.tv_nsec) / 1000000.0);
+    for (i = 0; i < nbufs; i++) {
+        free(bufs[i]);
+    }
+    free(bufs);
+    free(recs);
+    ddriver_close(fd);
+    return ret == 0 ? 0 : 1;
+}
@@ -8,6 +8,14 @@ int ddriver_open(char *path);
 int ddriver_seek(int fd, off_t offset, int whence);
 int ddriver_write(int fd, char *buf, size_t size);
 int ddriver_read(int fd, char *buf, size_t size);
+int ddriver_writev(int fd, char *buf, size_t size);
+int ddriver_readv(int fd, char *buf, size_t size);
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+char *ddriver_map_block(int fd, unsigned long long blkno);
+int ddriver_msync(int fd, off_t offset, size_t size);
+int ddriver_submit(int fd, struct ddriver_sqe *sqes, int cnt);
+int ddriver_reap(int fd, struct ddriver_cqe *cqes, int max, int min_complete);
 int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
 int ddriver_close(int fd);
 
@@ -5,10 +5,10 @@
 #include "stdio.h"
 
 /**
- * @brief 打开ddriver设备
+ * @brief 打开ddriver设备，同一进程内可同时打开多个，各自有独立的几何参数、统计和日志
  * 
- * @param path ddriver设备路径
- * @return int 0成功，否则失败
+ * @param path ddriver设备路径，任意镜像文件，不存在时创建；配置和日志为该路径加_conf、_log后缀
+ * @return int 设备handler，小于0失败
  */
 int ddriver_open(char *path);
 
@@ -42,6 +42,91 @@ int ddriver_write(int fd, char *buf, size_t size);
  */
 int ddriver_read(int fd, char *buf, size_t size);
 
+/**
+ * @brief 连续写入多个IO单位，只计一次写延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，注意一定要是设备IO单位的整数倍
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_writev(int fd, char *buf, size_t size);
+
+/**
+ * @brief 连续读出多个IO单位，只计一次读延迟
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，注意一定要是设备IO单位的整数倍
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_readv(int fd, char *buf, size_t size);
+
+/**
+ * @brief 在指定位置写入数据，不使用seek的共享位置，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，注意一定要是设备IO单位的整数倍
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 在指定位置读出数据，不使用seek的共享位置，可多线程并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，注意一定要是设备IO单位的整数倍
+ * @param offset 读出位置，注意要和设备IO单位对齐
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 取得IO单位在镜像映射中的地址，读写不经过拷贝，仅mmap后端（DDRIVER_MMAP=1）可用
+ * 
+ * @param fd ddriver设备handler
+ * @param blkno IO单位编号
+ * @return char* 映射地址，不可用时返回NULL
+ */
+char *ddriver_map_block(int fd, unsigned long long blkno);
+
+/**
+ * @brief 将映射中的修改同步写回，非mmap后端时等价于fsync
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @param size 大小，为0时同步整个设备
+ * @return int 0成功，否则失败
+ */
+int ddriver_msync(int fd, off_t offset, size_t size);
+
+/**
+ * @brief 异步提交一批请求，由驱动的工作线程按提交顺序执行
+ * 
+ * 每个设备只有一个完成环，不区分提交者：ddriver_reap可能取回其他线程提交的请求。
+ * 同一设备上从提交到取回完自己全部请求的整个过程，调用者需自行串行化
+ * 
+ * @param fd ddriver设备handler
+ * @param sqes 请求数组，buf在对应的完成项取回前需保持有效
+ * @param cnt 请求个数
+ * @return int 实际提交的个数，在途请求达到队列深度（DDRIVER_QUEUE_DEPTH）时可能少于cnt，小于0失败
+ */
+int ddriver_submit(int fd, struct ddriver_sqe *sqes, int cnt);
+
+/**
+ * @brief 取回已完成的请求，按完成顺序，可能来自同一设备上任何一次提交
+ * 
+ * @param fd ddriver设备handler
+ * @param cqes 完成项数组
+ * @param max 最多取回的个数
+ * @param min_complete 至少等到这么多个完成，超过在途请求数时按在途请求数计
+ * @return int 取回的个数
+ */
+int ddriver_reap(int fd, struct ddriver_cqe *cqes, int max, int min_complete);
+
 /**
  * @brief ddriver IO控制
  * 
@@ -9,6 +9,7 @@
 #include "string.h"
 #include "fuse.h"
 #include <stddef.h>
+#include <pthread.h>
 #include "ddriver.h"
 #include "errno.h"
 #include "types.h"
@@ -22,16 +23,24 @@
 *******************************************************************************/
 char* 			   newfs_get_fname(const char* path);
 int 			   newfs_calc_lvl(const char * path);
-int 			   newfs_driver_read(int offset, uint8_t *out_content, int size);
-int 			   newfs_driver_write(int offset, uint8_t *in_content, int size);
+int 			   newfs_driver_read(uint64_t offset, uint8_t *out_content, int size);
+int 			   newfs_driver_write(uint64_t offset, uint8_t *in_content, int size);
+int 			   newfs_driver_discard(uint64_t offset, uint64_t size);
+int 			   newfs_driver_flush();
 
 
 int 			   newfs_mount(struct custom_options options);
 int 			   newfs_umount();
+void 			   newfs_dump_io_stat();
 
 int 			   newfs_alloc_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry);
 int 			   newfs_drop_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry);
 struct newfs_inode*newfs_alloc_inode(struct newfs_dentry * dentry);
+int 			   newfs_alloc_data_blk();
+int 			   newfs_alloc_data_blks(int n, int* dnos);
+int 			   newfs_free_data_blk(int dno);
+void 			   newfs_free_data_list(const int* dnos, int cnt);
+void 			   newfs_free_data_blks(struct newfs_inode * inode);
 int 			   newfs_sync_inode(struct newfs_inode * inode);
 int 			   newfs_drop_inode(struct newfs_inode * inode);
 struct newfs_inode*newfs_read_inode(struct newfs_dentry * dentry, int ino);
@@ -39,6 +48,77 @@ struct newfs_dentry* newfs_get_dentry(struct newfs_inode * inode, int dir);
 
 struct newfs_dentry* newfs_lookup(const char * path, boolean * is_find, boolean* is_root);
 
+/******************************************************************************
+* SECTION: newfs_bitmap.c
+*******************************************************************************/
+int 			   newfs_bitmap_init(struct newfs_bitmap* bm, uint8_t* map, uint64_t nbits);
+int64_t 		   newfs_bitmap_alloc(struct newfs_bitmap* bm);
+int64_t 		   newfs_bitmap_alloc_run(struct newfs_bitmap* bm, int n);
+int 			   newfs_bitmap_alloc_many(struct newfs_bitmap* bm, int64_t* bits, int n);
+int 			   newfs_bitmap_free(struct newfs_bitmap* bm, uint64_t bit);
+boolean 		   newfs_bitmap_test(struct newfs_bitmap* bm, uint64_t bit);
+boolean 		   newfs_bitmap_dirty(struct newfs_bitmap* bm, int blk_sz, uint64_t* start, uint64_t* end);
+void 			   newfs_bitmap_clean(struct newfs_bitmap* bm);
+
+/******************************************************************************
+* SECTION: newfs_arena.c
+*******************************************************************************/
+uint8_t* 		   newfs_arena_alloc(int size);
+void 			   newfs_arena_free(uint8_t* buf, int size);
+
+/******************************************************************************
+* SECTION: newfs_sched.c
+*******************************************************************************/
+int 			   newfs_sched_submit(struct newfs_io_req* reqs, int cnt);
+void 			   newfs_sched_plug();
+int 			   newfs_sched_unplug();
+int 			   newfs_sched_drain();
+int 			   newfs_sched_read(uint64_t offset, uint8_t *out_content, int size);
+int 			   newfs_sched_write(uint64_t offset, uint8_t *in_content, int size);
+int 			   newfs_sched_discard(uint64_t offset, uint64_t size);
+boolean 		   newfs_sched_pending(uint64_t offset, int size);
+
+/******************************************************************************
+* SECTION: newfs_cache.c
+*******************************************************************************/
+int 			   newfs_cache_init(int cache_kb);
+void 			   newfs_cache_destroy();
+struct newfs_buf*  newfs_buf_get(uint64_t blkno, boolean fill);
+void 			   newfs_buf_put(struct newfs_buf* buf);
+int 			   newfs_cache_prefetch(const uint64_t* blknos, int cnt);
+void 			   newfs_buf_dirty(struct newfs_buf* buf);
+int 			   newfs_cache_read(uint64_t offset, uint8_t *out_content, int size);
+int 			   newfs_cache_write(uint64_t offset, uint8_t *in_content, int size);
+void 			   newfs_cache_forget(uint64_t blkno);
+const uint8_t*     newfs_cache_view(uint64_t offset, uint8_t *copy, int size);
+int 			   newfs_cache_sync();
+int 			   newfs_cache_dirty_cnt();
+int 			   newfs_cache_snapshot(struct newfs_buf_snap** snaps);
+void 			   newfs_cache_release(struct newfs_buf_snap* snaps, int cnt, boolean failed);
+
+/******************************************************************************
+* SECTION: newfs_writeback.c
+*******************************************************************************/
+void 			   newfs_mark_dirty(struct newfs_inode* inode, flag16 flags);
+void 			   newfs_clear_dirty(struct newfs_inode* inode);
+void 			   newfs_defer_free(int dno);
+int 			   newfs_writeback();
+uint64_t 		   newfs_dirty_bytes();
+int 			   newfs_writeback_sync(boolean barrier);
+int 			   newfs_writeback_final();
+int 			   newfs_flusher_start(int flush_age_ms, int dirty_kb);
+void 			   newfs_flusher_stop();
+
+/******************************************************************************
+* SECTION: newfs_journal.c
+*******************************************************************************/
+int 			   newfs_journal_init(boolean is_init);
+int 			   newfs_journal_commit(struct newfs_buf_snap* snaps, int cnt);
+int 			   newfs_journal_checkpoint(boolean force);
+void 			   newfs_journal_reap();
+void 			   newfs_journal_destroy();
+void 			   newfs_journal_dump_stat();
+
 /******************************************************************************
 * SECTION: newfs.c
 *******************************************************************************/
@@ -62,6 +142,10 @@ int   			   newfs_truncate(const char *, off_t);
 			
 int   			   newfs_open(const char *, struct fuse_file_info *);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
+int   			   newfs_flush(const char *, struct fuse_file_info *);
+int   			   newfs_fsync(const char *, int, struct fuse_file_info *);
+int   			   newfs_getxattr(const char *, const char *, char *, size_t);
+int   			   newfs_listxattr(const char *, char *, size_t);
 
 
 #endif  /* _newfs_H_ */
\ No newline at end of file
@@ -24,13 +24,40 @@ typedef enum newfs_file_type {
 #define UINT8_BITS              8
 
 // 磁盘布局相关
-#define NEWFS_MAGIC_NUM           0x52415453  
+#define NEWFS_MAGIC_NUM           0x52415454  
 #define NEWFS_SUPER_OFS           0
 #define NEWFS_ROOT_INO            0
 #define NEWFS_SUPER_BLKS          1
 #define NEWFS_INODE_MAP_BLKS      1
 #define NEWFS_DATA_MAP_BLKS       1
 
+// IO调度相关
+#define NEWFS_IO_READ             0
+#define NEWFS_IO_WRITE            1
+#define NEWFS_SCHED_MAX_QUEUE     (1024 * 1024)  /* plug期间最多积累的写数据量 */
+
+// 对齐缓冲区池相关
+#define NEWFS_ARENA_CLASSES       8              /* IO_SZ << 0 ... IO_SZ << 7 */
+#define NEWFS_ARENA_PER_CLASS     4              /* 每线程每级缓存的空闲缓冲区数 */
+#define NEWFS_ARENA_ALIGN         4096
+
+// 块缓存相关
+#define NEWFS_CACHE_DEFAULT_KB    256            /* 默认内存预算 */
+#define NEWFS_FLAG_BUF_DIRTY      0x1
+#define NEWFS_FLAG_BUF_OCCUPY     0x2            /* 缓存中的数据有效 */
+
+// 增量写回相关
+#define NEWFS_FLAG_INODE_DIRTY    0x1            /* newfs_inode_d需要重写 */
+#define NEWFS_FLAG_DATA_DIRTY     0x2            /* 目录项或文件数据需要重写 */
+#define NEWFS_FLUSH_AGE_DEFAULT_MS 5000          /* 修改最多在内存中停留的时间，0关闭写回线程 */
+#define NEWFS_DIRTY_DEFAULT_KB    64             /* 脏数据达到该量时提前写回 */
+
+// 元数据日志相关
+#define NEWFS_JOURNAL_MAGIC       0x4A524E4C
+#define NEWFS_JOURNAL_BLKS        128            /* 日志区块数，含日志超级块 */
+#define NEWFS_JOURNAL_MIN_BLKS    8              /* 设备太小、分不出这么多块时不建日志 */
+#define NEWFS_JOURNAL_F_CONT      0x1            /* 同一次提交还有后续事务 */
+
 // 错误类型
 #define NEWFS_ERROR_NONE          0
 #define NEWFS_ERROR_ACCESS        EACCES
@@ -42,6 +69,8 @@ typedef enum newfs_file_type {
 #define NEWFS_ERROR_UNSUPPORTED   ENXIO
 #define NEWFS_ERROR_IO            EIO     /* Error Input/Output */
 #define NEWFS_ERROR_INVAL         EINVAL  /* Invalid Args */
+#define NEWFS_ERROR_NOATTR        ENODATA /* No such attribute */
+#define NEWFS_ERROR_RANGE         ERANGE  /* Buffer too small */
 
 // 约束
 #define NEWFS_MAX_FILE_NAME       128
@@ -65,13 +94,17 @@ typedef enum newfs_file_type {
 #define NEWFS_ROUND_DOWN(value, round)    ((value) % (round) == 0 ? (value) : ((value) / (round)) * (round))
 #define NEWFS_ROUND_UP(value, round)      ((value) % (round) == 0 ? (value) : ((value) / (round) + 1) * (round))
 
-#define NEWFS_BLKS_SZ(blks)               ((blks) * NEWFS_BLK_SZ())
+#define NEWFS_BLKS_SZ(blks)               ((uint64_t)(blks) * NEWFS_BLK_SZ())
 #define NEWFS_ASSIGN_FNAME(pnewfs_dentry, _fname)\ 
                                         memcpy(pnewfs_dentry->fname, _fname, strlen(_fname))
 // 根据索引号求索引偏移
-#define NEWFS_INO_OFS(ino)                (newfs_super.inode_offset + ino*sizeof(struct newfs_inode_d))
+#define NEWFS_INO_OFS(ino)                (newfs_super.inode_offset + (uint64_t)(ino) * sizeof(struct newfs_inode_d))
 // 根据数据块号求数据块偏移
 #define NEWFS_DATA_OFS(ino)               (newfs_super.data_offset + (ino) * NEWFS_BLKS_SZ(1))
+// 每个数据块容纳的目录项数，目录项不跨块
+#define NEWFS_DENTRY_PER_BLK()            (NEWFS_BLK_SZ() / (int)sizeof(struct newfs_dentry_d))
+// 一个日志描述块最多记录的块数
+#define NEWFS_JOURNAL_DESC_CAP()          ((NEWFS_BLK_SZ() - (int)sizeof(struct newfs_journal_desc_d)) / (int)sizeof(uint64_t))
 // 文件类型判断
 #define NEWFS_IS_DIR(pinode)              (pinode->dentry->ftype == NEWFS_DIR)
 #define NEWFS_IS_REG(pinode)              (pinode->dentry->ftype == NEWFS_REG_FILE)
@@ -86,6 +119,9 @@ struct newfs_super;
 struct custom_options {
 	const char*        device;
 	boolean            show_help;
+	int                cache_kb;                      /* 块缓存内存预算 */
+	int                flush_age_ms;                  /* 脏数据过期时间 */
+	int                dirty_kb;                      /* 脏数据水位 */
 };
 
 struct newfs_inode
@@ -97,6 +133,9 @@ struct newfs_inode
     struct newfs_dentry*    dentry;                        /* 指向该inode的dentry */
     struct newfs_dentry*    dentrys;                       /* 所有目录项 */
     uint8_t*                data;                           /*数据*/
+    int                     blk_pointer[NEWFS_DATA_PER_FILE];  /* 磁盘上已占用的数据块，-1表示未用 */
+    flag16                  flags;                         /* NEWFS_FLAG_INODE_DIRTY / NEWFS_FLAG_DATA_DIRTY */
+    struct newfs_inode*     dirty_next;                    /* 脏链表，flags非0时在链表中 */
 };  
 
 struct newfs_dentry
@@ -109,6 +148,42 @@ struct newfs_dentry
     NEWFS_FILE_TYPE         ftype;
 };
 
+struct newfs_io_req
+{
+    int                     op;                            /* NEWFS_IO_READ / NEWFS_IO_WRITE */
+    uint64_t                offset;                        /* 与IO单位对齐 */
+    uint8_t*                buf;
+    int                     size;                          /* IO单位的整数倍 */
+};
+
+struct newfs_buf
+{
+    uint64_t                blkno;                         /* 逻辑块号 */
+    uint8_t*                data;
+    flag16                  flags;                         /* NEWFS_FLAG_BUF_* */
+    int                     pin_cnt;                       /* 大于0时不可淘汰 */
+    struct newfs_buf*       lru_prev;
+    struct newfs_buf*       lru_next;
+    struct newfs_buf*       hash_next;
+};
+
+struct newfs_buf_snap
+{
+    struct newfs_buf*       buf;                           /* 写出期间保持pin */
+    uint64_t                blkno;
+    uint8_t*                data;                          /* 取快照时的块内容 */
+};
+
+struct newfs_bitmap
+{
+    uint64_t*               words;                         /* 指向位图的内存镜像 */
+    uint64_t                nbits;                         /* 可分配的位数 */
+    uint64_t                nfree;                         /* 空闲位计数 */
+    uint64_t                hint;                          /* next-fit游标 */
+    uint64_t                dirty_lo;                      /* 上次写回后被修改过的位范围[dirty_lo, dirty_hi) */
+    uint64_t                dirty_hi;
+};
+
 struct newfs_super
 {
     uint32_t           magic; // 幻数
@@ -116,27 +191,55 @@ struct newfs_super
     
     int                sz_io; // 512B
     int                sz_blk; // 512<<1
-    int                sz_disk; // 4MB
-    int                sz_usage; // 已占用空间
+    uint64_t           sz_disk; // 设备大小
+    uint64_t           sz_usage; // 已占用空间
     
     int                max_ino; // 最大索引节点数
     uint8_t*           map_inode; // inode位图内存指针
+    struct newfs_bitmap bm_inode; // inode位图分配器
     int                map_inode_blks; 
-    int                map_inode_offset;
+    uint64_t           map_inode_offset;
 
     int                max_dno; // 最大索引节点数
     uint8_t*           map_data; // data位图内存指针
+    struct newfs_bitmap bm_data; // data位图分配器
     int                map_data_blks;  
-    int                map_data_offset;
+    uint64_t           map_data_offset;
 
     
-    int                inode_offset;
-    int                data_offset;
+    uint64_t           inode_offset;
+    uint64_t           data_offset;
     uint32_t           inode_per_blk;
     uint32_t           inode_blks;
 
     boolean            is_mounted;
     struct newfs_dentry* root_dentry;
+
+    struct newfs_inode* dirty_list; // 待写回的inode
+    int                dirty_cnt;
+    uint64_t           dirty_since_ms; // 最早一次未写回的修改，0表示没有
+    int*               free_defer;    // 待释放的数据块，引用它们的旧inode还在磁盘上
+    int                free_defer_cnt;
+    int                free_defer_cap;
+
+    pthread_mutex_t    lock;          // 保护目录树、位图和块缓存
+    pthread_mutex_t    io_lock;       // 保护调度器和设备，可重入，需要两者时先取lock
+    pthread_cond_t     flush_cond;    // 唤醒写回线程，与lock配合
+    pthread_t          flusher;
+    boolean            flusher_running;
+    boolean            flusher_stop;
+    int                flush_age_ms;
+    uint64_t           dirty_limit;   // 脏数据字节数水位
+    int                flush_age_cnt;      // 因过期触发的写回次数
+    int                flush_pressure_cnt; // 因超过水位触发的写回次数
+    int                flush_sync_cnt;     // 因fsync/flush触发的写回次数
+    uint64_t           flush_blks;         // 以上写回写出的块数
+
+    uint64_t           journal_offset; // 元数据日志区
+    int                journal_blks;   // 0表示没有日志（旧格式）
+
+    int                io_rmw_read;   // 写前预读的IO单位数
+    int                io_rmw_saved;  // 因完整覆盖省去预读的IO单位数
 };
 
 static inline struct newfs_dentry* new_dentry(char * fname, NEWFS_FILE_TYPE ftype) {
@@ -157,20 +260,42 @@ static inline struct newfs_dentry* new_dentry(char * fname, NEWFS_FILE_TYPE ftyp
 struct newfs_super_d
 {
     uint32_t           magic_num;
-    uint32_t           sz_usage;
+    uint32_t           inode_per_blk;
+    uint64_t           sz_usage;
     
     uint32_t           max_ino;
     uint32_t           map_inode_blks;
-    uint32_t           map_inode_offset;
+    uint64_t           map_inode_offset;
 
     uint32_t           max_dno;
     uint32_t           map_data_blks;
-    uint32_t           map_data_offset;
+    uint64_t           map_data_offset;
 
-    uint32_t           inode_offset;
-    uint32_t           data_offset;
-    uint32_t           inode_per_blk;
+    uint64_t           inode_offset;
+    uint64_t           data_offset;
     uint32_t           inode_blks;
+
+    uint64_t           journal_offset;                /* 环形元数据日志区，位于超级块之后 */
+    uint32_t           journal_blks;                  /* 旧格式为0，不使用日志 */
+};
+
+struct newfs_journal_sb_d                             /* 日志区第一块 */
+{
+    uint32_t           magic;
+    uint32_t           blks;
+    uint64_t           tail_seq;                      /* 最早一个尚未检查点的事务 */
+    uint32_t           tail;                          /* 该事务在日志区中的块号 */
+};
+
+struct newfs_journal_desc_d                           /* 事务的描述块，其后紧跟cnt个块的新内容 */
+{
+    uint32_t           magic;
+    uint32_t           flags;                         /* NEWFS_JOURNAL_F_CONT */
+    uint64_t           seq;
+    uint32_t           cnt;
+    uint32_t           pad;
+    uint64_t           csum;                          /* 描述块（本字段记0）和各块内容的校验和 */
+    uint64_t           blknos[];                      /* 各块的逻辑块号 */
 };
 
 struct newfs_inode_d
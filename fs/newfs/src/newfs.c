@@ -1,6 +1,7 @@
 #define _XOPEN_SOURCE 700
 
 #include "newfs.h"
+#include <limits.h>
 
 /******************************************************************************
 * SECTION: 宏定义
@@ -12,6 +13,9 @@
 *******************************************************************************/
 static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
 	OPTION("--device=%s", device),
+	OPTION("--cache_kb=%d", cache_kb),
+	OPTION("--flush_age_ms=%d", flush_age_ms),
+	OPTION("--dirty_kb=%d", dirty_kb),
 	FUSE_OPT_END
 };
 
@@ -37,7 +41,25 @@ static struct fuse_operations operations = {
 
 	.open = NULL,							
 	.opendir = NULL,
-	.access = NULL
+	.access = NULL,
+	.flush = newfs_flush,					 /* close时写回 */
+	.fsync = newfs_fsync,					 /* 写回并等待落盘 */
+	.fsyncdir = newfs_fsync,
+	.getxattr = newfs_getxattr,				 /* 读取运行时统计 */
+	.listxattr = newfs_listxattr
+};
+/* 挂载点根目录上只读的统计属性，可用getfattr -d -m user.newfs <挂载点>查看 */
+static const char* newfs_stat_names[] = {
+	"user.newfs.io_rmw_read",				 /* 写前预读的IO单位数 */
+	"user.newfs.io_rmw_saved",				 /* 因完整覆盖省去预读的IO单位数 */
+	"user.newfs.dirty_inodes",				 /* 待写回的inode数 */
+	"user.newfs.dirty_blocks",				 /* 块缓存中的脏块数 */
+	"user.newfs.dirty_bytes",				 /* 尚未落盘的数据量估计，与--dirty_kb比较 */
+	"user.newfs.flush_age",					 /* 因过期触发的写回次数 */
+	"user.newfs.flush_pressure",			 /* 因超过水位触发的写回次数 */
+	"user.newfs.flush_sync",				 /* 因fsync/flush触发的写回次数 */
+	"user.newfs.flush_blocks",				 /* 以上写回写出的块数 */
+	NULL
 };
 /******************************************************************************
 * SECTION: 必做函数实现
@@ -89,15 +111,19 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	(void)mode;
 	boolean is_find, is_root;
 	char* fname;
-	struct newfs_dentry* last_dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* last_dentry;
 	struct newfs_dentry* dentry;
 	struct newfs_inode*  inode;
 
+	pthread_mutex_lock(&newfs_super.lock);
+	last_dentry = newfs_lookup(path, &is_find, &is_root);
 	if (is_find) {
+		pthread_mutex_unlock(&newfs_super.lock);
 		return -NEWFS_ERROR_EXISTS;
 	}
 
 	if (NEWFS_IS_REG(last_dentry->inode)) {
+		pthread_mutex_unlock(&newfs_super.lock);
 		return -NEWFS_ERROR_UNSUPPORTED;
 	}
 
@@ -106,6 +132,7 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	dentry->parent = last_dentry;
 	inode  = newfs_alloc_inode(dentry);
 	newfs_alloc_dentry(last_dentry->inode, dentry);
+	pthread_mutex_unlock(&newfs_super.lock);
 	
 	return NEWFS_ERROR_NONE;
 }
@@ -120,8 +147,12 @@ int newfs_mkdir(const char* path, mode_t mode) {
 int newfs_getattr(const char* path, struct stat * newfs_stat) {
 	/* TODO: 解析路径，获取Inode，填充newfs_stat，可参考/fs/simplefs/newfs.c的newfs_getattr()函数实现 */
 	boolean	is_find, is_root;
-	struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* dentry;
+
+	pthread_mutex_lock(&newfs_super.lock);
+	dentry = newfs_lookup(path, &is_find, &is_root);
 	if (is_find == FALSE) {
+		pthread_mutex_unlock(&newfs_super.lock);
 		return -NEWFS_ERROR_NOTFOUND;
 	}
 
@@ -146,6 +177,7 @@ int newfs_getattr(const char* path, struct stat * newfs_stat) {
 		newfs_stat->st_blocks = NEWFS_DISK_SZ() / NEWFS_IO_SZ();
 		newfs_stat->st_nlink  = 2;		/* !特殊，根目录link数为2 */
 	}
+	pthread_mutex_unlock(&newfs_super.lock);
 	return NEWFS_ERROR_NONE;
 }
 
@@ -173,17 +205,22 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
 	boolean	is_find, is_root;
 	int		cur_dir = offset;
 
-	struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* dentry;
 	struct newfs_dentry* sub_dentry;
 	struct newfs_inode* inode;
+
+	pthread_mutex_lock(&newfs_super.lock);
+	dentry = newfs_lookup(path, &is_find, &is_root);
 	if (is_find) {
 		inode = dentry->inode;
 		sub_dentry = newfs_get_dentry(inode, cur_dir);
 		if (sub_dentry) {
 			filler(buf, sub_dentry->fname, NULL, ++offset);
 		}
+		pthread_mutex_unlock(&newfs_super.lock);
 		return NEWFS_ERROR_NONE;
 	}
+	pthread_mutex_unlock(&newfs_super.lock);
 	return -NEWFS_ERROR_NOTFOUND;
 }
 
@@ -199,12 +236,15 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	/* TODO: 解析路径，并创建相应的文件 */
 	boolean	is_find, is_root;
 	
-	struct newfs_dentry* last_dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* last_dentry;
 	struct newfs_dentry* dentry;
 	struct newfs_inode* inode;
 	char* fname;
 	
+	pthread_mutex_lock(&newfs_super.lock);
+	last_dentry = newfs_lookup(path, &is_find, &is_root);
 	if (is_find == TRUE) {
+		pthread_mutex_unlock(&newfs_super.lock);
 		return -NEWFS_ERROR_EXISTS;
 	}
 
@@ -222,6 +262,7 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	dentry->parent = last_dentry;
 	inode = newfs_alloc_inode(dentry);
 	newfs_alloc_dentry(last_dentry->inode, dentry);
+	pthread_mutex_unlock(&newfs_super.lock);
 
 	return NEWFS_ERROR_NONE;
 }
@@ -366,15 +407,136 @@ int newfs_access(const char* path, int type) {
 	/* 选做: 解析路径，判断是否存在 */
 	return 0;
 }	
+
+/**
+ * @brief 关闭文件时写回全部修改，不等待落盘
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi 可忽略
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_flush(const char* path, struct fuse_file_info* fi) {
+	(void)path;
+	return newfs_writeback_sync(FALSE);
+}
+
+/**
+ * @brief 写回全部修改并等待落盘，元数据是全局的，不区分文件
+ * 
+ * @param path 相对于挂载点的路径
+ * @param datasync 可忽略
+ * @param fi 可忽略
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	(void)path;
+	(void)datasync;
+	return newfs_writeback_sync(TRUE);
+}
+/**
+ * @brief 取第idx个统计属性的值
+ */
+static uint64_t newfs_stat_value(int idx) {
+	uint64_t val;
+
+	if (idx < 2) {								 /* 预读计数在io_lock下更新 */
+		pthread_mutex_lock(&newfs_super.io_lock);
+		val = idx == 0 ? newfs_super.io_rmw_read : newfs_super.io_rmw_saved;
+		pthread_mutex_unlock(&newfs_super.io_lock);
+		return val;
+	}
+	pthread_mutex_lock(&newfs_super.lock);
+	switch (idx)
+	{
+	case 2: val = newfs_super.dirty_cnt; break;
+	case 3: val = newfs_cache_dirty_cnt(); break;
+	case 4: val = newfs_dirty_bytes(); break;
+	case 5: val = newfs_super.flush_age_cnt; break;
+	case 6: val = newfs_super.flush_pressure_cnt; break;
+	case 7: val = newfs_super.flush_sync_cnt; break;
+	case 8: val = newfs_super.flush_blks; break;
+	default: val = 0; break;
+	}
+	pthread_mutex_unlock(&newfs_super.lock);
+	return val;
+}
+
+/**
+ * @brief 读取挂载点根目录上的统计属性，值为十进制文本
+ * 
+ * @param path 相对于挂载点的路径，只有根目录有统计属性
+ * @param name 属性名
+ * @param value 输出缓冲区
+ * @param size 缓冲区大小，为0时只返回所需大小
+ * @return int 值的长度，否则返回对应错误号
+ */
+int newfs_getxattr(const char* path, const char* name, char* value, size_t size) {
+	char text[32];
+	int  i, len;
+
+	if (strcmp(path, "/") != 0) {
+		return -NEWFS_ERROR_NOATTR;
+	}
+	for (i = 0; newfs_stat_names[i] != NULL; i++) {
+		if (strcmp(name, newfs_stat_names[i]) == 0) {
+			break;
+		}
+	}
+	if (newfs_stat_names[i] == NULL) {
+		return -NEWFS_ERROR_NOATTR;
+	}
+	len = snprintf(text, sizeof(text), "%llu", (unsigned long long)newfs_stat_value(i));
+	if (size == 0) {
+		return len;
+	}
+	if (size < (size_t)len) {
+		return -NEWFS_ERROR_RANGE;
+	}
+	memcpy(value, text, len);
+	return len;
+}
+
+/**
+ * @brief 列出统计属性名，各名字以\0结尾依次存放
+ * 
+ * @param path 相对于挂载点的路径
+ * @param list 输出缓冲区
+ * @param size 缓冲区大小，为0时只返回所需大小
+ * @return int 列表的长度，否则返回对应错误号
+ */
+int newfs_listxattr(const char* path, char* list, size_t size) {
+	size_t len = 0, n;
+	int    i;
+
+	if (strcmp(path, "/") != 0) {
+		return 0;
+	}
+	for (i = 0; newfs_stat_names[i] != NULL; i++) {
+		n = strlen(newfs_stat_names[i]) + 1;
+		if (size != 0 && len + n > size) {
+			return -NEWFS_ERROR_RANGE;
+		}
+		if (size != 0) {
+			memcpy(list + len, newfs_stat_names[i], n);
+		}
+		len += n;
+	}
+	return len;
+}
 /******************************************************************************
 * SECTION: FUSE入口
 *******************************************************************************/
 int main(int argc, char **argv)
 {
     int ret;
+	char device[PATH_MAX];
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-	newfs_options.device = strdup("~/user-land-filesystem/driver");
+	snprintf(device, sizeof(device), "%s/ddriver", getenv("HOME"));	/* 默认设备，可用--device指定任意镜像 */
+	newfs_options.device = strdup(device);
+	newfs_options.cache_kb = NEWFS_CACHE_DEFAULT_KB;
+	newfs_options.flush_age_ms = NEWFS_FLUSH_AGE_DEFAULT_MS;
+	newfs_options.dirty_kb = NEWFS_DIRTY_DEFAULT_KB;
 
 	if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
 		return -1;
@@ -0,0 +1,102 @@
+#include "../include/newfs.h"
+#include <pthread.h>
+extern struct newfs_super      newfs_super;
+
+/******************************************************************************
+* SECTION: 对齐缓冲区池
+*
+* 驱动读写和调度器合并时需要临时的对齐缓冲区。每个线程按大小分级缓存若干块
+* 已释放的缓冲区，热路径上不再进入malloc。第c级的大小为 NEWFS_IO_SZ() << c，
+* 超过最大一级的请求直接分配和释放。
+*******************************************************************************/
+struct newfs_arena {
+    int       io_sz;                                  /* 分级所依据的IO单位，挂载不同设备时会变 */
+    uint8_t*  free_bufs[NEWFS_ARENA_CLASSES][NEWFS_ARENA_PER_CLASS];
+    int       free_cnt[NEWFS_ARENA_CLASSES];
+};
+
+static pthread_key_t              newfs_arena_key;
+static pthread_once_t             newfs_arena_once = PTHREAD_ONCE_INIT;
+static __thread struct newfs_arena* newfs_arena_local = NULL;
+
+static void newfs_arena_drain(struct newfs_arena* arena) {
+    int c, i;
+    for (c = 0; c < NEWFS_ARENA_CLASSES; c++) {
+        for (i = 0; i < arena->free_cnt[c]; i++) {
+            free(arena->free_bufs[c][i]);
+        }
+        arena->free_cnt[c] = 0;
+    }
+}
+
+static void newfs_arena_release(void* arg) {
+    newfs_arena_drain((struct newfs_arena*)arg);
+    free(arg);
+}
+
+static void newfs_arena_key_init() {
+    pthread_key_create(&newfs_arena_key, newfs_arena_release);
+}
+
+static struct newfs_arena* newfs_arena_get() {
+    if (newfs_arena_local == NULL) {
+        pthread_once(&newfs_arena_once, newfs_arena_key_init);
+        newfs_arena_local = (struct newfs_arena*)calloc(1, sizeof(struct newfs_arena));
+        if (newfs_arena_local == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(newfs_arena_key, newfs_arena_local);
+    }
+    if (newfs_arena_local->io_sz != NEWFS_IO_SZ()) {
+        newfs_arena_drain(newfs_arena_local);
+        newfs_arena_local->io_sz = NEWFS_IO_SZ();
+    }
+    return newfs_arena_local;
+}
+/**
+ * @brief 求size对应的级别，超过最大一级返回-1
+ */
+static int newfs_arena_class(int size) {
+    int c;
+    for (c = 0; c < NEWFS_ARENA_CLASSES; c++) {
+        if (size <= (NEWFS_IO_SZ() << c)) {
+            return c;
+        }
+    }
+    return -1;
+}
+/**
+ * @brief 分配一个按NEWFS_ARENA_ALIGN对齐、至少size字节的缓冲区
+ *
+ * @param size
+ * @return uint8_t* 内存不足时返回NULL，调用者需检查
+ */
+uint8_t* newfs_arena_alloc(int size) {
+    struct newfs_arena* arena = newfs_arena_get();
+    int      c = newfs_arena_class(size);
+    void*    buf;
+
+    if (arena != NULL && c >= 0 && arena->free_cnt[c] > 0) {
+        return arena->free_bufs[c][--arena->free_cnt[c]];
+    }
+    if (posix_memalign(&buf, NEWFS_ARENA_ALIGN, c >= 0 ? (NEWFS_IO_SZ() << c) : size) != 0) {
+        return NULL;
+    }
+    return (uint8_t*)buf;
+}
+/**
+ * @brief 归还newfs_arena_alloc分配的缓冲区，size需与分配时一致
+ *
+ * @param buf
+ * @param size
+ */
+void newfs_arena_free(uint8_t* buf, int size) {
+    struct newfs_arena* arena = newfs_arena_get();
+    int c = newfs_arena_class(size);
+
+    if (arena != NULL && c >= 0 && arena->free_cnt[c] < NEWFS_ARENA_PER_CLASS) {
+        arena->free_bufs[c][arena->free_cnt[c]++] = buf;
+        return;
+    }
+    free(buf);
+}
@@ -0,0 +1,242 @@
+#include "../include/newfs.h"
+#include <endian.h>
+
+/******************************************************************************
+* SECTION: 位图分配器
+*
+* 位图在磁盘上按字节存放（第i位位于第i/8字节的第i%8位），在内存中按小端64位字
+* 访问，二者布局一致。查找空闲位时整字跳过已满的字，用ctz定位；维护空闲位计数
+* 和next-fit游标，分配从上次分配的位置继续向后找，释放只清一位。修改过的位范围
+* 记录在dirty_lo/dirty_hi中，写回时只写覆盖该范围的块。
+*******************************************************************************/
+#define NEWFS_WORD_BITS                 64
+#define NEWFS_WORD(bm, w)               le64toh((bm)->words[w])
+#define NEWFS_BIT_MASK(bit)             ((uint64_t)1 << ((bit) % NEWFS_WORD_BITS))
+
+/**
+ * @brief 第w个字中不属于位图范围的高位按已占用处理
+ */
+static uint64_t newfs_bitmap_word(struct newfs_bitmap* bm, uint64_t w) {
+    uint64_t word = NEWFS_WORD(bm, w);
+    uint64_t tail = bm->nbits - w * NEWFS_WORD_BITS;
+    if (tail < NEWFS_WORD_BITS) {
+        word |= ~(uint64_t)0 << tail;
+    }
+    return word;
+}
+/**
+ * @brief 从from开始找第一个值为is_set的位
+ *
+ * @return uint64_t 找不到时返回bm->nbits
+ */
+static uint64_t newfs_bitmap_find(struct newfs_bitmap* bm, uint64_t from, boolean is_set) {
+    uint64_t nwords = (bm->nbits + NEWFS_WORD_BITS - 1) / NEWFS_WORD_BITS;
+    uint64_t w      = from / NEWFS_WORD_BITS;
+    uint64_t word;
+
+    if (from >= bm->nbits) {
+        return bm->nbits;
+    }
+    word  = is_set ? newfs_bitmap_word(bm, w) : ~newfs_bitmap_word(bm, w);
+    word &= ~(uint64_t)0 << (from % NEWFS_WORD_BITS);
+    while (word == 0) {
+        if (++w >= nwords) {
+            return bm->nbits;
+        }
+        word = is_set ? newfs_bitmap_word(bm, w) : ~newfs_bitmap_word(bm, w);
+    }
+    from = w * NEWFS_WORD_BITS + __builtin_ctzll(word);
+    return from < bm->nbits ? from : bm->nbits;
+}
+/**
+ * @brief 将[start, end)并入修改过的范围
+ */
+static void newfs_bitmap_touch(struct newfs_bitmap* bm, uint64_t start, uint64_t end) {
+    if (start < bm->dirty_lo) bm->dirty_lo = start;
+    if (end > bm->dirty_hi)   bm->dirty_hi = end;
+}
+/**
+ * @brief 将[start, start + n)置位
+ */
+static void newfs_bitmap_set_range(struct newfs_bitmap* bm, uint64_t start, uint64_t n) {
+    uint64_t bit;
+    for (bit = start; bit < start + n; bit++) {
+        bm->words[bit / NEWFS_WORD_BITS] |= htole64(NEWFS_BIT_MASK(bit));
+    }
+    newfs_bitmap_touch(bm, start, start + n);
+}
+/**
+ * @brief 在[from, to)内找长度至少为n的空闲段
+ *
+ * @return int64_t 段起始位，找不到返回-1
+ */
+static int64_t newfs_bitmap_find_run(struct newfs_bitmap* bm, uint64_t from, uint64_t to, int n) {
+    uint64_t start, end;
+    while (from < to) {
+        start = newfs_bitmap_find(bm, from, FALSE);
+        if (start >= to) {
+            break;
+        }
+        end = newfs_bitmap_find(bm, start, TRUE);
+        if (end - start >= (uint64_t)n) {
+            return start;
+        }
+        from = end;
+    }
+    return -1;
+}
+/**
+ * @brief 在map上建立位图，map的长度需为8字节的整数倍且至少覆盖nbits位
+ *
+ * @param bm
+ * @param map 位图在内存中的镜像，位图直接在其上修改
+ * @param nbits 可分配的位数
+ * @return int
+ */
+int newfs_bitmap_init(struct newfs_bitmap* bm, uint8_t* map, uint64_t nbits) {
+    uint64_t nwords = (nbits + NEWFS_WORD_BITS - 1) / NEWFS_WORD_BITS;
+    uint64_t w, used = 0;
+
+    bm->words = (uint64_t*)map;
+    bm->nbits = nbits;
+    bm->hint  = 0;
+    newfs_bitmap_clean(bm);
+    for (w = 0; w < nwords; w++) {
+        uint64_t word = NEWFS_WORD(bm, w);
+        if (w == nwords - 1 && nbits % NEWFS_WORD_BITS) {
+            word &= ~(~(uint64_t)0 << (nbits % NEWFS_WORD_BITS));
+        }
+        used += __builtin_popcountll(word);
+    }
+    bm->nfree = nbits - used;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 分配n个连续的空闲位，从next-fit游标开始找，到尾后回绕
+ *
+ * @param bm
+ * @param n
+ * @return int64_t 起始位，空间不足返回-NEWFS_ERROR_NOSPACE
+ */
+int64_t newfs_bitmap_alloc_run(struct newfs_bitmap* bm, int n) {
+    int64_t start;
+
+    if (n <= 0 || bm->nfree < (uint64_t)n) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    start = newfs_bitmap_find_run(bm, bm->hint, bm->nbits, n);
+    if (start < 0) {
+        start = newfs_bitmap_find_run(bm, 0, bm->hint, n);
+    }
+    if (start < 0) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    newfs_bitmap_set_range(bm, start, n);
+    bm->nfree -= n;
+    bm->hint   = start + n < bm->nbits ? start + n : 0;
+    return start;
+}
+/**
+ * @brief 分配n个空闲位，有足够长的空闲段时整段分配，否则从next-fit游标开始依次取
+ *        各空闲段拼凑，空闲空间零碎但总量足够时也能分配成功
+ *
+ * @param bm
+ * @param bits 输出分配到的n个位，按段依次存放
+ * @param n
+ * @return int 空间不足返回-NEWFS_ERROR_NOSPACE，此时不分配任何位
+ */
+int newfs_bitmap_alloc_many(struct newfs_bitmap* bm, int64_t* bits, int n) {
+    int64_t  start = newfs_bitmap_alloc_run(bm, n);
+    uint64_t from, end, len;
+    int      got = 0;
+
+    if (start >= 0) {
+        while (got < n) {
+            bits[got] = start + got;
+            got++;
+        }
+        return NEWFS_ERROR_NONE;
+    }
+    if (n <= 0 || bm->nfree < (uint64_t)n) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    from = bm->hint;
+    while (got < n) {                                 /* 空闲位总数够，回绕后一定能取满 */
+        start = newfs_bitmap_find(bm, from, FALSE);
+        if ((uint64_t)start >= bm->nbits) {
+            from = 0;
+            continue;
+        }
+        end = newfs_bitmap_find(bm, start, TRUE);
+        len = end - start < (uint64_t)(n - got) ? end - start : (uint64_t)(n - got);
+        newfs_bitmap_set_range(bm, start, len);
+        for (end = 0; end < len; end++) {
+            bits[got++] = start + end;
+        }
+        from = start + len;
+    }
+    bm->nfree -= n;
+    bm->hint   = from < bm->nbits ? from : 0;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 分配一个空闲位
+ *
+ * @param bm
+ * @return int64_t 分配到的位，空间不足返回-NEWFS_ERROR_NOSPACE
+ */
+int64_t newfs_bitmap_alloc(struct newfs_bitmap* bm) {
+    return newfs_bitmap_alloc_run(bm, 1);
+}
+/**
+ * @brief 释放一位，O(1)
+ *
+ * @param bm
+ * @param bit
+ * @return int
+ */
+int newfs_bitmap_free(struct newfs_bitmap* bm, uint64_t bit) {
+    if (bit >= bm->nbits || !newfs_bitmap_test(bm, bit)) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    bm->words[bit / NEWFS_WORD_BITS] &= htole64(~NEWFS_BIT_MASK(bit));
+    bm->nfree++;
+    newfs_bitmap_touch(bm, bit, bit + 1);
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 查询一位是否已被占用
+ *
+ * @param bm
+ * @param bit
+ * @return boolean
+ */
+boolean newfs_bitmap_test(struct newfs_bitmap* bm, uint64_t bit) {
+    return (NEWFS_WORD(bm, bit / NEWFS_WORD_BITS) & NEWFS_BIT_MASK(bit)) != 0;
+}
+/**
+ * @brief 求上次写回后被修改过的部分在位图内存镜像中的字节范围，按blk_sz对齐
+ *
+ * @param bm
+ * @param blk_sz
+ * @param start 起始字节
+ * @param end 结束字节（不含）
+ * @return boolean 没有修改时返回FALSE
+ */
+boolean newfs_bitmap_dirty(struct newfs_bitmap* bm, int blk_sz, uint64_t* start, uint64_t* end) {
+    if (bm->dirty_lo >= bm->dirty_hi) {
+        return FALSE;
+    }
+    *start = bm->dirty_lo / UINT8_BITS / blk_sz * blk_sz;
+    *end   = NEWFS_ROUND_UP((bm->dirty_hi + UINT8_BITS - 1) / UINT8_BITS, (uint64_t)blk_sz);
+    return TRUE;
+}
+/**
+ * @brief 标记位图已全部写回
+ *
+ * @param bm
+ */
+void newfs_bitmap_clean(struct newfs_bitmap* bm) {
+    bm->dirty_lo = bm->nbits;
+    bm->dirty_hi = 0;
+}
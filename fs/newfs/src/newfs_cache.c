@@ -0,0 +1,476 @@
+#include "../include/newfs.h"
+extern struct newfs_super      newfs_super;
+
+/******************************************************************************
+* SECTION: 块缓存
+*
+* 以逻辑块号为键的LRU缓存。newfs_utils.c中的所有元数据和数据访问都经过这里，
+* 对同一块的多次修改只在被淘汰或newfs_cache_sync时写回一次。被pin住的块不会
+* 被淘汰，有日志时脏块也不会；没有可淘汰的块时允许临时超出内存预算。
+*******************************************************************************/
+static struct {
+    struct newfs_buf**  buckets;                      /* blkno -> buf 哈希表 */
+    int                 bucket_cnt;                   /* 2的幂 */
+    struct newfs_buf*   lru_head;                     /* 最近使用 */
+    struct newfs_buf*   lru_tail;                     /* 最久未使用，优先淘汰 */
+    int                 buf_cnt;
+    int                 max_bufs;                     /* 内存预算，单位为块 */
+    int                 dirty_cnt;
+} newfs_cache = { NULL, 0, NULL, NULL, 0, 0, 0 };
+
+#define NEWFS_CACHE_HASH(blkno)         ((blkno) & (newfs_cache.bucket_cnt - 1))
+
+static void newfs_lru_unlink(struct newfs_buf* buf) {
+    if (buf->lru_prev) buf->lru_prev->lru_next = buf->lru_next;
+    else               newfs_cache.lru_head    = buf->lru_next;
+    if (buf->lru_next) buf->lru_next->lru_prev = buf->lru_prev;
+    else               newfs_cache.lru_tail    = buf->lru_prev;
+    buf->lru_prev = buf->lru_next = NULL;
+}
+
+static void newfs_lru_push_head(struct newfs_buf* buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = newfs_cache.lru_head;
+    if (newfs_cache.lru_head) newfs_cache.lru_head->lru_prev = buf;
+    else                      newfs_cache.lru_tail           = buf;
+    newfs_cache.lru_head = buf;
+}
+
+static void newfs_hash_remove(struct newfs_buf* buf) {
+    struct newfs_buf** link = &newfs_cache.buckets[NEWFS_CACHE_HASH(buf->blkno)];
+    while (*link && *link != buf) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = buf->hash_next;
+    }
+    buf->hash_next = NULL;
+}
+
+static struct newfs_buf* newfs_hash_find(uint64_t blkno) {
+    struct newfs_buf* buf = newfs_cache.buckets[NEWFS_CACHE_HASH(blkno)];
+    while (buf && buf->blkno != blkno) {
+        buf = buf->hash_next;
+    }
+    return buf;
+}
+/**
+ * @brief 将脏块写回设备
+ *
+ * @param buf
+ * @return int
+ */
+static int newfs_buf_writeback(struct newfs_buf* buf) {
+    if (!(buf->flags & NEWFS_FLAG_BUF_DIRTY)) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (newfs_driver_write(NEWFS_BLKS_SZ(buf->blkno), buf->data,
+                           NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    buf->flags &= ~NEWFS_FLAG_BUF_DIRTY;
+    newfs_cache.dirty_cnt--;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 取得一个空闲的缓存块：未达预算时新分配，否则淘汰最久未使用且未被pin的块
+ *
+ * @return struct newfs_buf* 内存不足时返回NULL
+ */
+static struct newfs_buf* newfs_buf_alloc() {
+    struct newfs_buf* victim = newfs_cache.lru_tail;
+
+    if (newfs_cache.buf_cnt >= newfs_cache.max_bufs) {
+        while (victim && (victim->pin_cnt > 0 ||      /* 有日志时脏块只能经日志提交，不能直接写回原位 */
+               (newfs_super.journal_blks > 0 && (victim->flags & NEWFS_FLAG_BUF_DIRTY)))) {
+            victim = victim->lru_prev;
+        }
+        if (victim && newfs_buf_writeback(victim) == NEWFS_ERROR_NONE) {
+            newfs_lru_unlink(victim);
+            newfs_hash_remove(victim);
+            victim->flags = 0;
+            return victim;
+        }
+    }
+
+    victim = (struct newfs_buf*)calloc(1, sizeof(struct newfs_buf));
+    if (victim == NULL) {
+        return NULL;
+    }
+    if (posix_memalign((void**)&victim->data, NEWFS_ARENA_ALIGN, NEWFS_BLK_SZ()) != 0) {
+        free(victim);                                 /* 对齐以免O_DIRECT设备再经中转Buf */
+        return NULL;
+    }
+    newfs_cache.buf_cnt++;
+    return victim;
+}
+/**
+ * @brief 初始化块缓存
+ *
+ * @param cache_kb 内存预算，单位KB
+ * @return int
+ */
+int newfs_cache_init(int cache_kb) {
+    int max_bufs = cache_kb * 1024 / NEWFS_BLK_SZ();
+
+    newfs_cache.max_bufs   = max_bufs > 0 ? max_bufs : 1;
+    newfs_cache.bucket_cnt = 1;
+    while (newfs_cache.bucket_cnt < newfs_cache.max_bufs) {
+        newfs_cache.bucket_cnt <<= 1;
+    }
+    newfs_cache.buckets   = (struct newfs_buf**)calloc(newfs_cache.bucket_cnt,
+                                                       sizeof(struct newfs_buf*));
+    newfs_cache.lru_head  = NULL;
+    newfs_cache.lru_tail  = NULL;
+    newfs_cache.buf_cnt   = 0;
+    newfs_cache.dirty_cnt = 0;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 释放块缓存，调用前应先newfs_cache_sync
+ */
+void newfs_cache_destroy() {
+    struct newfs_buf* buf = newfs_cache.lru_head;
+    struct newfs_buf* next;
+    while (buf) {
+        next = buf->lru_next;
+        free(buf->data);
+        free(buf);
+        buf = next;
+    }
+    free(newfs_cache.buckets);
+    newfs_cache.buckets  = NULL;
+    newfs_cache.lru_head = NULL;
+    newfs_cache.lru_tail = NULL;
+    newfs_cache.buf_cnt  = 0;
+}
+/**
+ * @brief 取得逻辑块blkno的缓存并pin住，用完需newfs_buf_put
+ *
+ * @param blkno 逻辑块号
+ * @param fill 不命中时是否从设备读入，调用者将覆盖整块时可传FALSE
+ * @return struct newfs_buf* 失败返回NULL
+ */
+struct newfs_buf* newfs_buf_get(uint64_t blkno, boolean fill) {
+    struct newfs_buf* buf = newfs_hash_find(blkno);
+
+    if (buf) {
+        newfs_lru_unlink(buf);
+    }
+    else {
+        buf = newfs_buf_alloc();
+        if (buf == NULL) {
+            return NULL;
+        }
+        buf->blkno = blkno;
+        if (fill && newfs_driver_read(NEWFS_BLKS_SZ(blkno), buf->data,
+                                      NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+            free(buf->data);
+            free(buf);
+            newfs_cache.buf_cnt--;
+            return NULL;
+        }
+        buf->flags     = fill ? NEWFS_FLAG_BUF_OCCUPY : 0;
+        buf->hash_next = newfs_cache.buckets[NEWFS_CACHE_HASH(blkno)];
+        newfs_cache.buckets[NEWFS_CACHE_HASH(blkno)] = buf;
+    }
+    newfs_lru_push_head(buf);
+    buf->pin_cnt++;
+    return buf;
+}
+/**
+ * @brief 预读一批逻辑块，不在缓存中的作为一批读请求交给调度器，相邻的块合并为一次设备IO
+ *
+ * 只是提示：最多占用一半内存预算，失败时丢弃已分配的缓存块
+ *
+ * @param blknos 可以有重复
+ * @param cnt
+ * @return int
+ */
+int newfs_cache_prefetch(const uint64_t* blknos, int cnt) {
+    struct newfs_io_req* reqs;
+    struct newfs_buf**   bufs;
+    struct newfs_buf*    buf;
+    int n = 0, i, ret;
+
+    cnt  = cnt < newfs_cache.max_bufs / 2 ? cnt : newfs_cache.max_bufs / 2;
+    if (cnt <= 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    reqs = (struct newfs_io_req*)malloc(cnt * sizeof(struct newfs_io_req));
+    bufs = (struct newfs_buf**)malloc(cnt * sizeof(struct newfs_buf*));
+
+    pthread_mutex_lock(&newfs_super.io_lock);
+    for (i = 0; i < cnt; i++) {
+        if (newfs_hash_find(blknos[i]) != NULL ||     /* 已缓存，或调度队列中有更新的内容 */
+            newfs_sched_pending(NEWFS_BLKS_SZ(blknos[i]), NEWFS_BLK_SZ())) {
+            continue;
+        }
+        if ((buf = newfs_buf_alloc()) == NULL) {      /* 内存不足，已分配的照常预读 */
+            break;
+        }
+        buf->blkno     = blknos[i];
+        buf->flags     = 0;
+        buf->pin_cnt   = 1;                           /* 读完之前不可被淘汰 */
+        buf->hash_next = newfs_cache.buckets[NEWFS_CACHE_HASH(buf->blkno)];
+        newfs_cache.buckets[NEWFS_CACHE_HASH(buf->blkno)] = buf;
+        newfs_lru_push_head(buf);
+        reqs[n].op     = NEWFS_IO_READ;
+        reqs[n].offset = NEWFS_BLKS_SZ(buf->blkno);
+        reqs[n].buf    = buf->data;
+        reqs[n].size   = NEWFS_BLK_SZ();
+        bufs[n++]      = buf;
+    }
+    ret = newfs_sched_submit(reqs, n);
+    pthread_mutex_unlock(&newfs_super.io_lock);
+
+    for (i = 0; i < n; i++) {
+        bufs[i]->pin_cnt--;
+        if (ret == NEWFS_ERROR_NONE) {
+            bufs[i]->flags = NEWFS_FLAG_BUF_OCCUPY;
+            continue;
+        }
+        newfs_lru_unlink(bufs[i]);
+        newfs_hash_remove(bufs[i]);
+        free(bufs[i]->data);
+        free(bufs[i]);
+        newfs_cache.buf_cnt--;
+    }
+    free(bufs);
+    free(reqs);
+    return ret;
+}
+/**
+ * @brief 解除pin
+ *
+ * @param buf
+ */
+void newfs_buf_put(struct newfs_buf* buf) {
+    buf->pin_cnt--;
+}
+/**
+ * @brief 标记块内容已被修改
+ *
+ * @param buf
+ */
+void newfs_buf_dirty(struct newfs_buf* buf) {
+    if (!(buf->flags & NEWFS_FLAG_BUF_DIRTY)) {
+        newfs_cache.dirty_cnt++;
+    }
+    buf->flags |= NEWFS_FLAG_BUF_DIRTY | NEWFS_FLAG_BUF_OCCUPY;
+}
+/**
+ * @brief 丢弃逻辑块blkno的缓存，脏数据不再写回，用于块被释放时
+ *
+ * @param blkno
+ */
+void newfs_cache_forget(uint64_t blkno) {
+    struct newfs_buf* buf = newfs_hash_find(blkno);
+
+    if (buf == NULL) {
+        return;
+    }
+    if (buf->flags & NEWFS_FLAG_BUF_DIRTY) {
+        newfs_cache.dirty_cnt--;
+    }
+    buf->flags &= ~NEWFS_FLAG_BUF_DIRTY;
+    if (buf->pin_cnt > 0) {                           /* 仍被使用，只撤销写回 */
+        return;
+    }
+    newfs_lru_unlink(buf);
+    newfs_hash_remove(buf);
+    free(buf->data);
+    free(buf);
+    newfs_cache.buf_cnt--;
+}
+/**
+ * @brief 经缓存读
+ *
+ * @param offset
+ * @param out_content
+ * @param size
+ * @return int
+ */
+int newfs_cache_read(uint64_t offset, uint8_t *out_content, int size) {
+    struct newfs_buf* buf;
+    uint64_t blkno = offset / NEWFS_BLK_SZ();
+    int bias  = offset % NEWFS_BLK_SZ();
+    int len;
+
+    while (size > 0) {
+        len = NEWFS_BLK_SZ() - bias < size ? NEWFS_BLK_SZ() - bias : size;
+        buf = newfs_buf_get(blkno, TRUE);
+        if (buf == NULL) {
+            return -NEWFS_ERROR_IO;
+        }
+        memcpy(out_content, buf->data + bias, len);
+        newfs_buf_put(buf);
+        out_content += len;
+        size        -= len;
+        bias         = 0;
+        blkno++;
+    }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 不拷贝地取得[offset, offset + size)的最新内容，范围不能跨块
+ *
+ * 块在缓存中时返回缓存内的地址；否则若设备为mmap后端且调度队列中没有该范围的写，
+ * 返回镜像映射中的地址，不填充缓存。两者都不可用时读入copy。返回的地址只读，
+ * 且只保证在下一次缓存或设备操作之前有效。
+ *
+ * @param offset
+ * @param copy 回退时的读入位置，至少size字节
+ * @param size
+ * @return const uint8_t* 失败返回NULL
+ */
+const uint8_t* newfs_cache_view(uint64_t offset, uint8_t *copy, int size) {
+    struct newfs_buf* buf = newfs_hash_find(offset / NEWFS_BLK_SZ());
+    uint64_t unit;
+    char*    map = NULL;
+
+    if (offset % NEWFS_BLK_SZ() + size > (uint64_t)NEWFS_BLK_SZ()) {
+        return newfs_cache_read(offset, copy, size) == NEWFS_ERROR_NONE ? copy : NULL;
+    }
+    if (buf && (buf->flags & NEWFS_FLAG_BUF_OCCUPY)) {
+        newfs_lru_unlink(buf);
+        newfs_lru_push_head(buf);
+        return buf->data + offset % NEWFS_BLK_SZ();
+    }
+    pthread_mutex_lock(&newfs_super.io_lock);         /* 写回线程可能正在写镜像 */
+    if (buf == NULL && !newfs_sched_pending(offset, size)) {
+        for (unit = offset / NEWFS_IO_SZ(); unit <= (offset + size - 1) / NEWFS_IO_SZ(); unit++) {
+            char* unit_map = ddriver_map_block(NEWFS_DRIVER(), unit);
+            if (unit_map == NULL) {
+                map = NULL;
+                break;
+            }
+            map = map ? map : unit_map;
+        }
+    }
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    if (map) {
+        return (const uint8_t*)map + offset % NEWFS_IO_SZ();
+    }
+    return newfs_cache_read(offset, copy, size) == NEWFS_ERROR_NONE ? copy : NULL;
+}
+/**
+ * @brief 经缓存写，只修改缓存并标脏，整块覆盖时不读设备
+ *
+ * @param offset
+ * @param in_content
+ * @param size
+ * @return int
+ */
+int newfs_cache_write(uint64_t offset, uint8_t *in_content, int size) {
+    struct newfs_buf* buf;
+    uint64_t blkno = offset / NEWFS_BLK_SZ();
+    int bias  = offset % NEWFS_BLK_SZ();
+    int len;
+
+    while (size > 0) {
+        len = NEWFS_BLK_SZ() - bias < size ? NEWFS_BLK_SZ() - bias : size;
+        buf = newfs_buf_get(blkno, len != NEWFS_BLK_SZ());
+        if (buf == NULL) {
+            return -NEWFS_ERROR_IO;
+        }
+        memcpy(buf->data + bias, in_content, len);
+        newfs_buf_dirty(buf);
+        newfs_buf_put(buf);
+        in_content += len;
+        size       -= len;
+        bias        = 0;
+        blkno++;
+    }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 将所有脏块作为一批交给调度器写回
+ *
+ * @return int
+ */
+int newfs_cache_sync() {
+    struct newfs_buf* buf;
+    int ret = NEWFS_ERROR_NONE;
+
+    pthread_mutex_lock(&newfs_super.io_lock);
+    newfs_sched_plug();
+    for (buf = newfs_cache.lru_head; buf; buf = buf->lru_next) {
+        if (newfs_buf_writeback(buf) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    if (newfs_sched_unplug() != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    return ret;
+}
+/**
+ * @brief 脏块数
+ *
+ * @return int
+ */
+int newfs_cache_dirty_cnt() {
+    return newfs_cache.dirty_cnt;
+}
+/**
+ * @brief 复制所有脏块的内容并清除脏标记，调用者可以放开newfs_super.lock再写出副本
+ *
+ * 快照中的块保持pin直到newfs_cache_release，不会被淘汰，写出失败时仍能重新标脏；
+ * 期间块被再次修改只会在缓存中重新变脏，不影响副本。
+ *
+ * @param snaps 返回快照数组，无脏块时为NULL
+ * @return int 快照块数，内存不足时返回-NEWFS_ERROR_NOSPACE，所有块仍是脏的
+ */
+int newfs_cache_snapshot(struct newfs_buf_snap** snaps) {
+    struct newfs_buf* buf;
+    int cnt = 0;
+
+    *snaps = NULL;
+    if (newfs_cache.dirty_cnt == 0) {
+        return 0;
+    }
+    *snaps = (struct newfs_buf_snap*)malloc(newfs_cache.dirty_cnt * sizeof(struct newfs_buf_snap));
+    if (*snaps == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    for (buf = newfs_cache.lru_head; buf; buf = buf->lru_next) {
+        if (!(buf->flags & NEWFS_FLAG_BUF_DIRTY)) {
+            continue;
+        }
+        (*snaps)[cnt].buf   = buf;
+        (*snaps)[cnt].blkno = buf->blkno;
+        (*snaps)[cnt].data  = newfs_arena_alloc(NEWFS_BLK_SZ());
+        if ((*snaps)[cnt].data == NULL) {
+            newfs_cache.dirty_cnt -= cnt;             /* 已取的块交给release重新标脏 */
+            newfs_cache_release(*snaps, cnt, TRUE);
+            *snaps = NULL;
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        memcpy((*snaps)[cnt].data, buf->data, NEWFS_BLK_SZ());
+        buf->flags &= ~NEWFS_FLAG_BUF_DIRTY;
+        buf->pin_cnt++;
+        cnt++;
+    }
+    newfs_cache.dirty_cnt -= cnt;
+    return cnt;
+}
+/**
+ * @brief 释放newfs_cache_snapshot取得的快照
+ *
+ * @param snaps
+ * @param cnt
+ * @param failed 写出失败，重新标脏以便下次写回
+ */
+void newfs_cache_release(struct newfs_buf_snap* snaps, int cnt, boolean failed) {
+    int i;
+    for (i = 0; i < cnt; i++) {
+        if (failed) {
+            newfs_buf_dirty(snaps[i].buf);
+        }
+        newfs_buf_put(snaps[i].buf);
+        newfs_arena_free(snaps[i].data, NEWFS_BLK_SZ());
+    }
+    free(snaps);
+}
@@ -0,0 +1,418 @@
+#include "../include/newfs.h"
+extern struct newfs_super      newfs_super;
+
+/******************************************************************************
+* SECTION: 元数据日志
+*
+* 日志区位于超级块之后：第0块是日志超级块，其余块环形存放事务。一次写回中所有
+* 脏元数据块作为一组事务，连同描述块拼成一段连续的Buf顺序写入日志区，只flush
+* 一次即提交。描述块中的校验和覆盖整组内容，写了一半的事务在重放时被忽略，不需要
+* 单独的提交块。已提交的块在缓存中保持pin并保留副本，直到检查点把它们写回原位
+* 并推进日志尾；日志用过一半时由写回线程在后台做检查点，空间不够时当场做。
+* 挂载时从日志尾开始重放完整的事务组。
+*
+* 提交和检查点都在持有io_lock、不持有newfs_super.lock时进行，检查点写完后的副本
+* 放入done，持有newfs_super.lock时由newfs_journal_reap在io_lock下取下后释放。
+*******************************************************************************/
+static struct {
+    uint64_t               seq;                       /* 下一个事务的序号 */
+    int                    head;                      /* 下一个事务写入的位置 */
+    int                    used;                      /* 日志尾之后已占用的块数，含绕回时跳过的块 */
+    struct newfs_buf_snap* pending;                   /* 已提交、尚未检查点的块 */
+    int                    pending_cnt;
+    int                    pending_cap;
+    struct newfs_buf_snap* done;                      /* 已写回原位、等待释放的块 */
+    int                    done_cnt;
+    int                    done_cap;
+    int                    commit_cnt;                /* 统计 */
+    uint64_t               commit_blks;
+    int                    ckpt_cnt;
+    int                    replay_cnt;
+} newfs_journal;
+
+#define NEWFS_JOURNAL_OFS(pos)          (newfs_super.journal_offset + NEWFS_BLKS_SZ(pos))
+
+static uint64_t newfs_journal_csum(uint64_t h, const uint8_t* buf, int size) {
+    int i;
+    for (i = 0; i < size; i++) {                      /* FNV-1a */
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+/**
+ * @brief 计算一个事务的校验和，desc之后紧跟数据块
+ */
+static uint64_t newfs_journal_txn_csum(struct newfs_journal_desc_d* desc) {
+    uint64_t saved = desc->csum;
+    uint64_t h;
+
+    desc->csum = 0;
+    h = newfs_journal_csum(0xcbf29ce484222325ULL, (uint8_t *)desc,
+                           NEWFS_BLKS_SZ(desc->cnt + 1));
+    desc->csum = saved;
+    return h;
+}
+
+static void newfs_journal_append(struct newfs_buf_snap** list, int* cnt, int* cap,
+                                 struct newfs_buf_snap* snaps, int n) {
+    if (*cnt + n > *cap) {
+        *cap  = *cnt + n > *cap * 2 ? *cnt + n : *cap * 2;
+        *list = (struct newfs_buf_snap*)realloc(*list, *cap * sizeof(struct newfs_buf_snap));
+    }
+    memcpy(*list + *cnt, snaps, n * sizeof(struct newfs_buf_snap));
+    *cnt += n;
+}
+/**
+ * @brief 写日志超级块，tail之前的事务都已在原位
+ */
+static int newfs_journal_write_sb(uint64_t tail_seq, int tail) {
+    uint8_t* blk = newfs_arena_alloc(NEWFS_BLK_SZ());
+    struct newfs_journal_sb_d* sb = (struct newfs_journal_sb_d *)blk;
+    int ret;
+
+    if (blk == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    memset(blk, 0, NEWFS_BLK_SZ());
+    sb->magic    = NEWFS_JOURNAL_MAGIC;
+    sb->blks     = newfs_super.journal_blks;
+    sb->tail_seq = tail_seq;
+    sb->tail     = tail;
+    ret = newfs_driver_write(NEWFS_JOURNAL_OFS(0), blk, NEWFS_BLK_SZ());
+    newfs_arena_free(blk, NEWFS_BLK_SZ());
+    return ret;
+}
+/**
+ * @brief 读出pos处的事务并校验，返回的Buf含描述块和数据块，用完由调用者释放
+ *
+ * @param out 不是序号为seq的完整事务时置为NULL
+ * @return int 内存不足时返回-NEWFS_ERROR_NOSPACE，此时不能当作日志已到末尾
+ */
+static int newfs_journal_read_txn(int pos, uint64_t seq, struct newfs_journal_desc_d** out) {
+    struct newfs_journal_desc_d* desc;
+    uint8_t* buf = newfs_arena_alloc(NEWFS_BLK_SZ());
+    uint8_t* txn;
+    int      cnt;
+
+    *out = NULL;
+    if (buf == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (newfs_driver_read(NEWFS_JOURNAL_OFS(pos), buf, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+        newfs_arena_free(buf, NEWFS_BLK_SZ());
+        return NEWFS_ERROR_NONE;
+    }
+    desc = (struct newfs_journal_desc_d *)buf;
+    cnt  = desc->cnt;
+    if (desc->magic != NEWFS_JOURNAL_MAGIC || desc->seq != seq || cnt <= 0 ||
+        cnt > NEWFS_JOURNAL_DESC_CAP() || pos + 1 + cnt > newfs_super.journal_blks) {
+        newfs_arena_free(buf, NEWFS_BLK_SZ());
+        return NEWFS_ERROR_NONE;
+    }
+    newfs_arena_free(buf, NEWFS_BLK_SZ());
+
+    txn = (uint8_t *)malloc(NEWFS_BLKS_SZ(cnt + 1));
+    if (txn == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    desc = (struct newfs_journal_desc_d *)txn;
+    if (newfs_driver_read(NEWFS_JOURNAL_OFS(pos), txn, NEWFS_BLKS_SZ(cnt + 1)) != NEWFS_ERROR_NONE ||
+        newfs_journal_txn_csum(desc) != desc->csum) {
+        free(txn);
+        return NEWFS_ERROR_NONE;
+    }
+    *out = desc;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 重放日志尾之后完整的事务组，然后清空日志
+ *
+ * @return int
+ */
+static int newfs_journal_replay(uint64_t seq, int pos) {
+    struct newfs_journal_desc_d** group = NULL;
+    struct newfs_journal_desc_d*  desc;
+    int  group_cnt = 0, group_cap = 0;
+    int  ret = NEWFS_ERROR_NONE;
+    int  err, i, j;
+
+    newfs_sched_plug();
+    while (TRUE) {
+        if (pos >= newfs_super.journal_blks) {
+            pos = 1;
+        }
+        err = newfs_journal_read_txn(pos, seq, &desc);
+        if (err == NEWFS_ERROR_NONE && desc == NULL && pos != 1 && group_cnt == 0) {
+            pos = 1;                                  /* 写入时放不下，绕回了开头 */
+            err = newfs_journal_read_txn(pos, seq, &desc);
+        }
+        if (err != NEWFS_ERROR_NONE) {
+            ret = err;
+            break;
+        }
+        if (desc == NULL) {
+            break;
+        }
+        if (group_cnt == group_cap) {
+            group_cap = group_cap ? group_cap * 2 : 4;
+            group = (struct newfs_journal_desc_d**)realloc(group, group_cap * sizeof(*group));
+        }
+        group[group_cnt++] = desc;
+        pos += 1 + desc->cnt;
+        seq++;
+        if (desc->flags & NEWFS_JOURNAL_F_CONT) {
+            continue;
+        }
+        for (i = 0; i < group_cnt; i++) {             /* 整组完整，写回原位 */
+            for (j = 0; j < (int)group[i]->cnt; j++) {
+                if (newfs_driver_write(NEWFS_BLKS_SZ(group[i]->blknos[j]),
+                                       (uint8_t *)group[i] + NEWFS_BLKS_SZ(j + 1),
+                                       NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+                    ret = -NEWFS_ERROR_IO;
+                }
+            }
+            free(group[i]);
+        }
+        newfs_journal.replay_cnt += group_cnt;
+        group_cnt = 0;
+    }
+    for (i = 0; i < group_cnt; i++) {                 /* 最后一组不完整，丢弃 */
+        free(group[i]);
+    }
+    free(group);
+    if (newfs_sched_unplug() != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    if (ret == NEWFS_ERROR_NONE && newfs_driver_flush() != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    if (ret != NEWFS_ERROR_NONE) {                    /* 日志保持原样，下次挂载再重放 */
+        return ret;
+    }
+    newfs_journal.seq = seq;
+    if (newfs_journal_write_sb(seq, 1) != NEWFS_ERROR_NONE ||
+        newfs_driver_flush() != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 挂载时初始化日志：新格式化时写日志超级块，否则重放日志
+ *
+ * 需在读入位图等元数据之前调用
+ *
+ * @param is_init 是否刚格式化
+ * @return int
+ */
+int newfs_journal_init(boolean is_init) {
+    uint8_t* blk;
+    struct newfs_journal_sb_d sb;
+    int ret;
+
+    memset(&newfs_journal, 0, sizeof(newfs_journal));
+    newfs_journal.seq  = 1;
+    newfs_journal.head = 1;
+    if (newfs_super.journal_blks == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (is_init) {
+        return newfs_journal_write_sb(newfs_journal.seq, newfs_journal.head);
+    }
+
+    blk = newfs_arena_alloc(NEWFS_BLK_SZ());
+    if (blk == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    ret = newfs_driver_read(NEWFS_JOURNAL_OFS(0), blk, NEWFS_BLK_SZ());
+    memcpy(&sb, blk, sizeof(struct newfs_journal_sb_d));
+    newfs_arena_free(blk, NEWFS_BLK_SZ());
+    if (ret != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    if (sb.magic != NEWFS_JOURNAL_MAGIC || (int)sb.blks != newfs_super.journal_blks ||
+        sb.tail < 1 || (int)sb.tail >= newfs_super.journal_blks) {
+        NEWFS_DBG("[%s] bad journal super block\n", __func__);
+        return -NEWFS_ERROR_IO;
+    }
+    ret = newfs_journal_replay(sb.tail_seq, sb.tail);
+    if (newfs_journal.replay_cnt > 0) {
+        NEWFS_DBG("[%s] replayed %d transactions\n", __func__, newfs_journal.replay_cnt);
+    }
+    return ret;
+}
+/**
+ * @brief 检查点：把已提交的块写回原位，落盘后推进日志尾，调用时持有io_lock
+ *
+ * @param force 为FALSE时日志用了一半以上才做
+ * @return int
+ */
+int newfs_journal_checkpoint(boolean force) {
+    int i, ret = NEWFS_ERROR_NONE;
+
+    if (newfs_super.journal_blks == 0 || newfs_journal.used == 0 ||
+        (!force && newfs_journal.used * 2 < newfs_super.journal_blks - 1)) {
+        return NEWFS_ERROR_NONE;
+    }
+    newfs_sched_plug();                               /* 按磁盘头顺序写回，同一块的新版本覆盖旧版本 */
+    for (i = 0; i < newfs_journal.pending_cnt; i++) {
+        if (newfs_driver_write(NEWFS_BLKS_SZ(newfs_journal.pending[i].blkno),
+                               newfs_journal.pending[i].data, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    if (newfs_sched_unplug() != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    if (ret != NEWFS_ERROR_NONE || newfs_driver_flush() != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    if (newfs_journal_write_sb(newfs_journal.seq, newfs_journal.head) != NEWFS_ERROR_NONE ||
+        newfs_driver_flush() != NEWFS_ERROR_NONE) {   /* 日志尾落盘后才能覆盖旧事务 */
+        return -NEWFS_ERROR_IO;
+    }
+    newfs_journal_append(&newfs_journal.done, &newfs_journal.done_cnt, &newfs_journal.done_cap,
+                         newfs_journal.pending, newfs_journal.pending_cnt);
+    newfs_journal.pending_cnt = 0;
+    newfs_journal.used        = 0;
+    newfs_journal.ckpt_cnt++;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 直接写回原位，用于一次提交比整个日志区还大时，不保证原子性
+ */
+static int newfs_journal_bypass(struct newfs_buf_snap* snaps, int cnt) {
+    int i, ret = newfs_journal_checkpoint(TRUE);      /* 先让旧事务落到原位，之后日志中没有它们的旧版本 */
+
+    if (ret != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    NEWFS_DBG("[%s] %d blocks exceed journal, write in place\n", __func__, cnt);
+    newfs_sched_plug();
+    for (i = 0; i < cnt; i++) {
+        if (newfs_driver_write(NEWFS_BLKS_SZ(snaps[i].blkno), snaps[i].data,
+                               NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    if (newfs_sched_unplug() != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    if (ret != NEWFS_ERROR_NONE || newfs_driver_flush() != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    newfs_journal_append(&newfs_journal.done, &newfs_journal.done_cnt, &newfs_journal.done_cap,
+                         snaps, cnt);
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 把一次写回的所有脏块作为一组事务提交：一次顺序写，一次flush。调用时持有io_lock
+ *
+ * 成功时snaps中各项归日志所有，调用者只释放数组本身；失败时仍归调用者
+ *
+ * @param snaps newfs_cache_snapshot取得的快照
+ * @param cnt
+ * @return int
+ */
+int newfs_journal_commit(struct newfs_buf_snap* snaps, int cnt) {
+    struct newfs_journal_desc_d* desc;
+    int      cap   = NEWFS_JOURNAL_DESC_CAP();
+    int      txns  = (cnt + cap - 1) / cap;
+    int      total = cnt + txns;
+    int      pos, waste = 0, i, n, done = 0;
+    uint8_t* buf;
+    uint8_t* txn;
+
+    if (cnt == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (total > newfs_super.journal_blks - 1) {
+        return newfs_journal_bypass(snaps, cnt);
+    }
+    pos = newfs_journal.head;
+    if (pos + total > newfs_super.journal_blks) {     /* 一组事务连续存放，放不下时绕回开头 */
+        waste = newfs_super.journal_blks - pos;
+        pos   = 1;
+    }
+    if (newfs_journal.used + waste + total > newfs_super.journal_blks - 1) {
+        if (newfs_journal_checkpoint(TRUE) != NEWFS_ERROR_NONE) {   /* 空间不够，当场检查点 */
+            return -NEWFS_ERROR_IO;
+        }
+        waste = 0;                                    /* 日志已空，从哪里开始都可以，重放时会绕回开头找 */
+    }
+
+    buf = (uint8_t *)calloc(total, NEWFS_BLK_SZ());
+    txn = buf;
+    for (i = 0; i < txns; i++) {
+        n    = cnt - done < cap ? cnt - done : cap;
+        desc = (struct newfs_journal_desc_d *)txn;
+        desc->magic = NEWFS_JOURNAL_MAGIC;
+        desc->flags = i + 1 < txns ? NEWFS_JOURNAL_F_CONT : 0;
+        desc->seq   = newfs_journal.seq + i;
+        desc->cnt   = n;
+        for (int j = 0; j < n; j++) {
+            desc->blknos[j] = snaps[done + j].blkno;
+            memcpy(txn + NEWFS_BLKS_SZ(j + 1), snaps[done + j].data, NEWFS_BLK_SZ());
+        }
+        desc->csum = newfs_journal_txn_csum(desc);
+        txn  += NEWFS_BLKS_SZ(n + 1);
+        done += n;
+    }
+    if (newfs_driver_write(NEWFS_JOURNAL_OFS(pos), buf, NEWFS_BLKS_SZ(total)) != NEWFS_ERROR_NONE ||
+        newfs_driver_flush() != NEWFS_ERROR_NONE) {
+        free(buf);
+        return -NEWFS_ERROR_IO;
+    }
+    free(buf);
+
+    newfs_journal.used += waste + total;
+    newfs_journal.head  = pos + total < newfs_super.journal_blks ? pos + total : 1;
+    newfs_journal.seq  += txns;
+    newfs_journal.commit_cnt++;
+    newfs_journal.commit_blks += cnt;
+    newfs_journal_append(&newfs_journal.pending, &newfs_journal.pending_cnt, &newfs_journal.pending_cap,
+                         snaps, cnt);
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 释放检查点已写回原位的块，持有newfs_super.lock时调用
+ *
+ * done由持有io_lock的检查点追加，先在io_lock下整个取下，再释放到缓存
+ */
+void newfs_journal_reap() {
+    struct newfs_buf_snap* done;
+    int cnt;
+
+    pthread_mutex_lock(&newfs_super.io_lock);
+    done = newfs_journal.done;
+    cnt  = newfs_journal.done_cnt;
+    newfs_journal.done     = NULL;
+    newfs_journal.done_cnt = 0;
+    newfs_journal.done_cap = 0;
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    if (cnt > 0) {
+        newfs_cache_release(done, cnt, FALSE);
+    }
+    else {
+        free(done);
+    }
+}
+/**
+ * @brief 卸载时释放日志的内存，调用前应已做过检查点
+ */
+void newfs_journal_destroy() {
+    newfs_journal_reap();
+    free(newfs_journal.pending);
+    newfs_journal.pending     = NULL;
+    newfs_journal.pending_cnt = 0;
+    newfs_journal.pending_cap = 0;
+}
+
+void newfs_journal_dump_stat() {
+    if (newfs_super.journal_blks == 0) {
+        return;
+    }
+    NEWFS_DBG("[newfs_dump_io_stat] journal: %d commits, %llu blocks, %d checkpoints, %d replayed\n",
+              newfs_journal.commit_cnt, (unsigned long long)newfs_journal.commit_blks,
+              newfs_journal.ckpt_cnt, newfs_journal.replay_cnt);
+}
@@ -0,0 +1,390 @@
+#include "../include/newfs.h"
+extern struct newfs_super      newfs_super;
+
+/******************************************************************************
+* SECTION: 电梯调度（C-LOOK）
+*
+* 所有设备IO都经过这里。plug之后的写请求先进入队列，unplug时统一按磁盘头方向
+* 排序（C-LOOK：从当前磁盘头位置向高地址扫描，到尾后跳回最低地址），相邻或
+* 重叠的请求合并为一次设备IO，一批中的各次设备IO经ddriver_submit同时在途。
+* 读请求总是立即下发（deadline：读优先），但会先用队列中尚未下发的写覆盖，
+* 保证读到最新数据。
+*******************************************************************************/
+struct newfs_sched_group {
+    int      start;                                   /* sorted中的起止下标 [start, end) */
+    int      end;
+    uint64_t ofs_start;
+    uint64_t ofs_end;
+};
+
+static struct {
+    int                   plug_depth;                 /* plug可嵌套，最外层unplug时下发 */
+    uint64_t              head;                       /* 上一次下发后磁盘头的位置 */
+    struct newfs_io_req*  queue;                      /* plug期间积累的写请求 */
+    int                   queue_cnt;
+    int                   queue_cap;
+    int                   queue_sz;                   /* 队列中数据的总字节数 */
+} newfs_sched = { 0, 0, NULL, 0, 0, 0 };
+
+/**
+ * @brief 按偏移排序，偏移相同按提交顺序（数组下标）
+ */
+static int newfs_sched_cmp_ofs(const void* a, const void* b) {
+    const struct newfs_io_req* ra = *(const struct newfs_io_req**)a;
+    const struct newfs_io_req* rb = *(const struct newfs_io_req**)b;
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return ra < rb ? -1 : (ra > rb);
+}
+/**
+ * @brief 按提交顺序排序，用于合并重叠写时保证新数据覆盖旧数据
+ */
+static int newfs_sched_cmp_seq(const void* a, const void* b) {
+    const struct newfs_io_req* ra = *(const struct newfs_io_req**)a;
+    const struct newfs_io_req* rb = *(const struct newfs_io_req**)b;
+    return ra < rb ? -1 : (ra > rb);
+}
+/**
+ * @brief 为一组合并后的请求准备异步提交项，组内请求操作相同且地址相邻或重叠
+ *
+ * 单个请求直接使用调用者的Buf，否则分配一段连续的Buf，写请求按提交顺序拷入
+ *
+ * @param sorted
+ * @param group
+ * @param sqe
+ * @return int
+ */
+static int newfs_sched_prepare(struct newfs_io_req** sorted, struct newfs_sched_group* group,
+                                struct ddriver_sqe* sqe) {
+    struct newfs_io_req* req = sorted[group->start];
+    int      size = group->ofs_end - group->ofs_start;
+    int      i;
+
+    sqe->op     = req->op == NEWFS_IO_READ ? DDRIVER_OP_READ : DDRIVER_OP_WRITE;
+    sqe->offset = group->ofs_start;
+    sqe->size   = size;
+    if (group->end - group->start == 1) {
+        sqe->buf = (char *)req->buf;
+        return NEWFS_ERROR_NONE;
+    }
+    sqe->buf = (char *)newfs_arena_alloc(size);
+    if (sqe->buf == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (req->op == NEWFS_IO_WRITE) {
+        qsort(sorted + group->start, group->end - group->start,
+              sizeof(struct newfs_io_req*), newfs_sched_cmp_seq);
+        for (i = group->start; i < group->end; i++) {
+            memcpy(sqe->buf + (sorted[i]->offset - group->ofs_start), sorted[i]->buf, sorted[i]->size);
+        }
+    }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 一组请求完成，读请求拷回调用者的Buf并释放合并用的Buf
+ *
+ * @param sorted
+ * @param group
+ * @param sqe
+ * @param res 设备返回的字节数
+ * @return int
+ */
+static int newfs_sched_complete(struct newfs_io_req** sorted, struct newfs_sched_group* group,
+                                struct ddriver_sqe* sqe, int res) {
+    int i;
+
+    if (group->end - group->start > 1) {
+        if (sqe->op == DDRIVER_OP_READ && res == (int)sqe->size) {
+            for (i = group->start; i < group->end; i++) {
+                memcpy(sorted[i]->buf, sqe->buf + (sorted[i]->offset - group->ofs_start), 
+                       sorted[i]->size);
+            }
+        }
+        newfs_arena_free((uint8_t *)sqe->buf, sqe->size);
+    }
+    return res == (int)sqe->size ? NEWFS_ERROR_NONE : -NEWFS_ERROR_IO;
+}
+/**
+ * @brief 提交一批IO请求，排序合并后按C-LOOK顺序异步下发
+ *
+ * 各组同时在途（不超过设备队列深度），先完成的读在后面的组还在服务时就拷回。
+ * 同一批中不应同时包含对同一地址的读和写。设备的完成环不区分提交者，调用时需
+ * 持有io_lock，保证取回的都是本批的完成项
+ *
+ * @param reqs 请求数组，offset和size需与IO单位对齐
+ * @param cnt
+ * @return int
+ */
+int newfs_sched_submit(struct newfs_io_req* reqs, int cnt) {
+    struct newfs_io_req**     sorted;
+    struct newfs_sched_group* groups;
+    struct ddriver_sqe*       sqes;
+    struct ddriver_cqe*       cqes;
+    int      group_cnt = 0, first = 0, submitted = 0, done = 0;
+    int      i, n, ret = NEWFS_ERROR_NONE;
+
+    if (cnt <= 0) {
+        return NEWFS_ERROR_NONE;
+    }
+
+    sorted = (struct newfs_io_req**)malloc(cnt * sizeof(struct newfs_io_req*));
+    groups = (struct newfs_sched_group*)malloc(cnt * sizeof(struct newfs_sched_group));
+    for (i = 0; i < cnt; i++) {
+        sorted[i] = &reqs[i];
+    }
+    qsort(sorted, cnt, sizeof(struct newfs_io_req*), newfs_sched_cmp_ofs);
+
+    for (i = 0; i < cnt; i++) {                       /* 相邻或重叠的同类请求归为一组 */
+        struct newfs_sched_group* last = group_cnt ? &groups[group_cnt - 1] : NULL;
+        if (last && sorted[last->start]->op == sorted[i]->op
+                 && sorted[i]->offset <= last->ofs_end) {
+            last->end = i + 1;
+            if (sorted[i]->offset + sorted[i]->size > last->ofs_end) {
+                last->ofs_end = sorted[i]->offset + sorted[i]->size;
+            }
+            continue;
+        }
+        groups[group_cnt].start     = i;
+        groups[group_cnt].end       = i + 1;
+        groups[group_cnt].ofs_start = sorted[i]->offset;
+        groups[group_cnt].ofs_end   = sorted[i]->offset + sorted[i]->size;
+        group_cnt++;
+    }
+
+    while (first < group_cnt && groups[first].ofs_start < newfs_sched.head) {
+        first++;                                      /* C-LOOK: 从磁盘头之后的第一组开始 */
+    }
+    sqes = (struct ddriver_sqe*)malloc(group_cnt * sizeof(struct ddriver_sqe));
+    cqes = (struct ddriver_cqe*)malloc(group_cnt * sizeof(struct ddriver_cqe));
+    for (i = 0; i < group_cnt; i++) {                 /* 按下发顺序排列，user_data为组下标 */
+        int g = (first + i) % group_cnt;
+        if (newfs_sched_prepare(sorted, &groups[g], &sqes[i]) != NEWFS_ERROR_NONE) {
+            while (--i >= 0) {                        /* 一个都不下发，释放已准备的Buf */
+                newfs_sched_complete(sorted, &groups[(first + i) % group_cnt], &sqes[i], -1);
+            }
+            ret  = -NEWFS_ERROR_NOSPACE;
+            done = group_cnt;                         /* 跳过下面的提交 */
+            break;
+        }
+        sqes[i].user_data = i;
+    }
+
+    while (done < group_cnt) {
+        if (submitted < group_cnt) {
+            n = ddriver_submit(NEWFS_DRIVER(), sqes + submitted, group_cnt - submitted);
+            if (n > 0) {
+                submitted += n;
+            }
+            else if (submitted == done) {             /* 无法提交，剩下的组直接失败 */
+                for (i = submitted; i < group_cnt; i++) {
+                    newfs_sched_complete(sorted, &groups[(first + i) % group_cnt], &sqes[i], -1);
+                }
+                ret = -NEWFS_ERROR_IO;
+                break;
+            }
+        }
+        n = ddriver_reap(NEWFS_DRIVER(), cqes, group_cnt, 1);
+        for (i = 0; i < n; i++) {
+            int k = cqes[i].user_data;
+            if (newfs_sched_complete(sorted, &groups[(first + k) % group_cnt], 
+                                     &sqes[k], cqes[i].res) != NEWFS_ERROR_NONE) {
+                ret = -NEWFS_ERROR_IO;
+            }
+        }
+        done += n;
+    }
+    newfs_sched.head = groups[(first + group_cnt - 1) % group_cnt].ofs_end;
+
+    free(cqes);
+    free(sqes);
+    free(groups);
+    free(sorted);
+    return ret;
+}
+/**
+ * @brief 开始积累写请求
+ */
+void newfs_sched_plug() {
+    newfs_sched.plug_depth++;
+}
+/**
+ * @brief 下发队列中积累的写请求，但不改变plug状态
+ *
+ * @return int
+ */
+static int newfs_sched_flush() {
+    int ret = newfs_sched_submit(newfs_sched.queue, newfs_sched.queue_cnt);
+    int i;
+    for (i = 0; i < newfs_sched.queue_cnt; i++) {
+        newfs_arena_free(newfs_sched.queue[i].buf, newfs_sched.queue[i].size);
+    }
+    newfs_sched.queue_cnt = 0;
+    newfs_sched.queue_sz  = 0;
+    return ret;
+}
+/**
+ * @brief 结束积累，最外层unplug时将队列中的写请求排序合并后下发
+ *
+ * @return int
+ */
+int newfs_sched_unplug() {
+    int ret;
+    if (--newfs_sched.plug_depth > 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    ret = newfs_sched_flush();
+    newfs_sched.plug_depth = 0;
+    free(newfs_sched.queue);
+    newfs_sched.queue     = NULL;
+    newfs_sched.queue_cap = 0;
+    return ret;
+}
+/**
+ * @brief 不论plug嵌套多少层，立即下发队列中剩余的写请求并解除plug，用于卸载
+ *
+ * @return int
+ */
+int newfs_sched_drain() {
+    if (newfs_sched.plug_depth == 0 && newfs_sched.queue_cnt == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (newfs_sched.plug_depth > 0) {
+        NEWFS_DBG("[%s] scheduler still plugged (depth %d)\n", __func__, newfs_sched.plug_depth);
+    }
+    newfs_sched.plug_depth = 1;
+    return newfs_sched_unplug();
+}
+/**
+ * @brief 写入与IO单位对齐的数据，plug期间进入队列，否则直接下发
+ *
+ * @param offset
+ * @param in_content
+ * @param size
+ * @return int
+ */
+int newfs_sched_write(uint64_t offset, uint8_t *in_content, int size) {
+    struct newfs_io_req* req;
+
+    if (newfs_sched.plug_depth == 0) {
+        struct newfs_io_req single = { NEWFS_IO_WRITE, offset, in_content, size };
+        return newfs_sched_submit(&single, 1);
+    }
+
+    if (newfs_sched.queue_cnt == newfs_sched.queue_cap) {
+        newfs_sched.queue_cap = newfs_sched.queue_cap ? newfs_sched.queue_cap * 2 : 64;
+        newfs_sched.queue = (struct newfs_io_req*)realloc(newfs_sched.queue,
+                            newfs_sched.queue_cap * sizeof(struct newfs_io_req));
+    }
+    req         = &newfs_sched.queue[newfs_sched.queue_cnt];
+    req->buf    = newfs_arena_alloc(size);
+    if (req->buf == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    newfs_sched.queue_cnt++;
+    req->op     = NEWFS_IO_WRITE;
+    req->offset = offset;
+    req->size   = size;
+    memcpy(req->buf, in_content, size);
+    newfs_sched.queue_sz += size;
+
+    if (newfs_sched.queue_sz >= NEWFS_SCHED_MAX_QUEUE) {  /* 队列过长，先下发一批 */
+        return newfs_sched_flush();
+    }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 队列中是否有与[offset, offset + size)重叠、尚未下发的写
+ *
+ * @param offset
+ * @param size
+ * @return boolean
+ */
+boolean newfs_sched_pending(uint64_t offset, int size) {
+    int i;
+    for (i = 0; i < newfs_sched.queue_cnt; i++) {
+        struct newfs_io_req* req = &newfs_sched.queue[i];
+        if (req->offset < offset + size && offset < req->offset + req->size) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/**
+ * @brief 丢弃与IO单位对齐的一段数据，队列中完全落在该范围内的写一并撤销
+ *
+ * @param offset
+ * @param size
+ * @return int
+ */
+int newfs_sched_discard(uint64_t offset, uint64_t size) {
+    struct ddriver_discard discard = { offset, size };
+    int i, kept = 0;
+
+    for (i = 0; i < newfs_sched.queue_cnt; i++) {
+        struct newfs_io_req* req = &newfs_sched.queue[i];
+        if (req->offset >= offset && req->offset + req->size <= offset + size) {
+            newfs_sched.queue_sz -= req->size;
+            newfs_arena_free(req->buf, req->size);
+            continue;
+        }
+        newfs_sched.queue[kept++] = *req;
+    }
+    newfs_sched.queue_cnt = kept;
+
+    if (ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_DISCARD, &discard) != 0) {
+        return -NEWFS_ERROR_IO;
+    }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 读出与IO单位对齐的数据，并用队列中尚未下发的写覆盖
+ *
+ * 如果读范围的每个IO单位都已在队列中，则不访问设备
+ *
+ * @param offset
+ * @param out_content
+ * @param size
+ * @return int
+ */
+int newfs_sched_read(uint64_t offset, uint8_t *out_content, int size) {
+    int      units = size / NEWFS_IO_SZ();
+    uint8_t* covered;
+    boolean  all_covered = TRUE;
+    int      i, u, ret = NEWFS_ERROR_NONE;
+
+    if (newfs_sched.queue_cnt == 0) {
+        struct newfs_io_req single = { NEWFS_IO_READ, offset, out_content, size };
+        return newfs_sched_submit(&single, 1);
+    }
+
+    covered = (uint8_t*)calloc(units, sizeof(uint8_t));
+    for (i = 0; i < newfs_sched.queue_cnt; i++) {
+        struct newfs_io_req* req = &newfs_sched.queue[i];
+        for (u = 0; u < units; u++) {
+            uint64_t unit_ofs = offset + (uint64_t)u * NEWFS_IO_SZ();
+            if (unit_ofs >= req->offset && unit_ofs < req->offset + req->size) {
+                covered[u] = TRUE;
+            }
+        }
+    }
+    for (u = 0; u < units; u++) {
+        all_covered &= covered[u];
+    }
+    free(covered);
+
+    if (!all_covered) {
+        struct newfs_io_req single = { NEWFS_IO_READ, offset, out_content, size };
+        ret = newfs_sched_submit(&single, 1);
+    }
+    for (i = 0; i < newfs_sched.queue_cnt; i++) {     /* 按提交顺序覆盖，后写的数据优先 */
+        struct newfs_io_req* req = &newfs_sched.queue[i];
+        uint64_t lo = req->offset > offset ? req->offset : offset;
+        uint64_t hi = req->offset + req->size < offset + size ?
+                      req->offset + req->size : offset + size;
+        if (lo < hi) {
+            memcpy(out_content + (lo - offset), req->buf + (lo - req->offset), hi - lo);
+        }
+    }
+    return ret;
+}
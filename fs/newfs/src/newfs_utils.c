@@ -44,54 +44,115 @@ int newfs_calc_lvl(const char * path) {
  * @param size 
  * @return int 
  */
-int newfs_driver_read(int offset, uint8_t *out_content, int size) {
-    int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_IO_SZ());
+int newfs_driver_read(uint64_t offset, uint8_t *out_content, int size) {
+    uint64_t offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_IO_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    // lseek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // read(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        ddriver_read(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        cur          += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();   
+    int      ret;
+    uint8_t* temp_content;
+
+    pthread_mutex_lock(&newfs_super.io_lock);
+    if (bias == 0 && size == size_aligned) {          /* 已对齐，直接读入调用者的Buf */
+        ret = newfs_sched_read(offset_aligned, out_content, size_aligned);
+        pthread_mutex_unlock(&newfs_super.io_lock);
+        return ret;
     }
-    memcpy(out_content, temp_content + bias, size); // ignore extra data
-    free(temp_content);
-    return NEWFS_ERROR_NONE;
+
+    temp_content = newfs_arena_alloc(size_aligned);
+    if (temp_content == NULL) {
+        pthread_mutex_unlock(&newfs_super.io_lock);
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    ret = newfs_sched_read(offset_aligned, temp_content, size_aligned);
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    if (ret == NEWFS_ERROR_NONE) {
+        memcpy(out_content, temp_content + bias, size); // ignore extra data
+    }
+    newfs_arena_free(temp_content, size_aligned);
+    return ret != NEWFS_ERROR_NONE ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
 }
 /**
- * @brief 驱动写
+ * @brief 驱动写，只预读首尾未被完整覆盖的IO单位
  * 
  * @param offset 
  * @param in_content 
  * @param size 
  * @return int 
  */
-int newfs_driver_write(int offset, uint8_t *in_content, int size) {
-    int      offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_IO_SZ());
+int newfs_driver_write(uint64_t offset, uint8_t *in_content, int size) {
+    uint64_t offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_IO_SZ());
     int      bias           = offset - offset_aligned;
     int      size_aligned   = NEWFS_ROUND_UP((size + bias), NEWFS_IO_SZ());
-    uint8_t* temp_content   = (uint8_t*)malloc(size_aligned);
-    uint8_t* cur            = temp_content;
-    newfs_driver_read(offset_aligned, temp_content, size_aligned);
-    memcpy(temp_content + bias, in_content, size);
-    
-    // lseek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        // write(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        ddriver_write(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        cur          += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();   
+    int      units          = size_aligned / NEWFS_IO_SZ();
+    int      tail           = (bias + size) % NEWFS_IO_SZ();
+    int      pre_read       = 0;
+    int      ret            = NEWFS_ERROR_NONE;
+    uint8_t* temp_content;
+
+    pthread_mutex_lock(&newfs_super.io_lock);
+    if (bias == 0 && tail == 0) {                     /* 完整覆盖，无需预读 */
+        newfs_super.io_rmw_saved += units;
+        ret = newfs_sched_write(offset_aligned, in_content, size_aligned);
+        pthread_mutex_unlock(&newfs_super.io_lock);
+        return ret;
+    }
+
+    temp_content = newfs_arena_alloc(size_aligned);
+    if (temp_content == NULL) {
+        pthread_mutex_unlock(&newfs_super.io_lock);
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (bias != 0) {                                  /* 首个IO单位部分覆盖 */
+        ret |= newfs_sched_read(offset_aligned, temp_content, NEWFS_IO_SZ());
+        pre_read++;
+    }
+    if (tail != 0 && (units > 1 || bias == 0)) {      /* 末尾IO单位部分覆盖，且未在上面读过 */
+        ret |= newfs_sched_read(offset_aligned + size_aligned - NEWFS_IO_SZ(),
+                                temp_content + size_aligned - NEWFS_IO_SZ(), NEWFS_IO_SZ());
+        pre_read++;
     }
+    newfs_super.io_rmw_read  += pre_read;
+    newfs_super.io_rmw_saved += units - pre_read;
+    if (ret == NEWFS_ERROR_NONE) {
+        memcpy(temp_content + bias, in_content, size);
+        ret = newfs_sched_write(offset_aligned, temp_content, size_aligned);
+    }
+    pthread_mutex_unlock(&newfs_super.io_lock);
 
-    free(temp_content);
-    return NEWFS_ERROR_NONE;
+    newfs_arena_free(temp_content, size_aligned);
+    return ret != NEWFS_ERROR_NONE ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 通知设备一段数据已不再使用
+ * 
+ * 只在数据块被释放时调用：newfs_drop_inode和newfs_fit_data_blks缩小文件时。
+ * newfs.c还没有实现unlink和truncate，这两条路径目前不会走到。
+ * 
+ * @param offset 与IO单位对齐
+ * @param size IO单位的整数倍
+ * @return int 
+ */
+int newfs_driver_discard(uint64_t offset, uint64_t size) {
+    int ret;
+    if (offset % NEWFS_IO_SZ() != 0 || size % NEWFS_IO_SZ() != 0) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    pthread_mutex_lock(&newfs_super.io_lock);
+    ret = newfs_sched_discard(offset, size);
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    return ret;
+}
+/**
+ * @brief 写屏障，返回时之前已下发的写都已持久化
+ * 
+ * @return int 
+ */
+int newfs_driver_flush() {
+    int ret;
+    pthread_mutex_lock(&newfs_super.io_lock);
+    ret = ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_FLUSH, NULL);
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    return ret != 0 ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
 }
 /**
  * @brief 将denry插入到inode中，采用头插法
@@ -109,6 +170,7 @@ int newfs_alloc_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
         inode->dentrys = dentry;
     }
     inode->dir_cnt++;
+    newfs_mark_dirty(inode, NEWFS_FLAG_INODE_DIRTY | NEWFS_FLAG_DATA_DIRTY);
     return inode->dir_cnt;
 }
 /**
@@ -142,6 +204,7 @@ int newfs_drop_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry)
         return -NEWFS_ERROR_NOTFOUND;
     }
     inode->dir_cnt--;
+    newfs_mark_dirty(inode, NEWFS_FLAG_INODE_DIRTY | NEWFS_FLAG_DATA_DIRTY);
     return inode->dir_cnt;
 }
 /**
@@ -152,30 +215,12 @@ int newfs_drop_dentry(struct newfs_inode * inode, struct newfs_dentry * dentry)
  */
 struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
     struct newfs_inode* inode;
+    int64_t ino_cursor = newfs_bitmap_alloc(&newfs_super.bm_inode);
     int byte_cursor = 0; 
     int bit_cursor  = 0; 
-    int ino_cursor  = 0;
-    boolean is_find_free_entry = FALSE;
-    /* 检查位图是否有空位 */
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_inode_blks); 
-         byte_cursor++)
-    {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if((newfs_super.map_inode[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                                                      /* 当前ino_cursor位置空闲 */
-                newfs_super.map_inode[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_entry = TRUE;           
-                break;
-            }
-            ino_cursor++;
-        }
-        if (is_find_free_entry) {
-            break;
-        }
-    }
 
-    if (!is_find_free_entry || ino_cursor == newfs_super.max_ino)
-        return -NEWFS_ERROR_NOSPACE;
+    if (ino_cursor < 0)
+        return NULL;
 
     inode = (struct newfs_inode*)malloc(sizeof(struct newfs_inode));
     inode->ino  = ino_cursor; 
@@ -189,6 +234,10 @@ struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
     inode->dir_cnt = 0;
     inode->dentrys = NULL;
     inode->data = NULL;
+    memset(inode->blk_pointer, -1, sizeof(inode->blk_pointer));
+    inode->flags = 0;
+    inode->dirty_next = NULL;
+    newfs_mark_dirty(inode, NEWFS_FLAG_INODE_DIRTY | NEWFS_FLAG_DATA_DIRTY);
 
     // debug
     byte_cursor = 0;
@@ -204,135 +253,191 @@ struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
     }
     return inode;
 }
+int newfs_alloc_data_blk(){
+    return newfs_bitmap_alloc(&newfs_super.bm_data);
+}
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
+ * @brief 分配n个数据块，尽量连续以便调度器合并为一次写，空闲空间零碎时分成多段
  * 
- * @param inode 
- * @return int 
+ * @param n 
+ * @param dnos 输出分配到的数据块号
+ * @return int 空间不足返回-NEWFS_ERROR_NOSPACE，此时不分配任何块
  */
+int newfs_alloc_data_blks(int n, int* dnos){
+    int64_t* bits = (int64_t *)malloc(n * sizeof(int64_t));
+    int      i, ret;
 
-int newfs_alloc_data_blk(){
-    int byte_cursor = 0; 
-    int bit_cursor  = 0; 
-    int data_cursor  = 0;
-    boolean is_find_free_entry = FALSE;
-    /* 检查位图是否有空位 */
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_data_blks); byte_cursor++)
-    {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if((newfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                                                      /* 当前ino_cursor位置空闲 */
-                newfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_entry = TRUE;           
-                break;
-            }
-            data_cursor++;
-        }
-        if (is_find_free_entry) {
-            break;
-        }
+    ret = newfs_bitmap_alloc_many(&newfs_super.bm_data, bits, n);
+    for (i = 0; ret == NEWFS_ERROR_NONE && i < n; i++) {
+        dnos[i] = bits[i];
     }
-    if (!is_find_free_entry || data_cursor == newfs_super.max_dno)
-        return -NEWFS_ERROR_NOSPACE;
-    return data_cursor;
+    free(bits);
+    return ret;
 }
 
+/**
+ * @brief 释放数据块，丢弃其缓存并通知设备
+ * 
+ * @param dno 
+ * @return int 
+ */
 int newfs_free_data_blk(int dno){
-    if (dno >= newfs_super.max_dno) return -1;
-    int byte_cursor = 0; 
-    int bit_cursor  = 0; 
-    int dno_cursor  = 0;
-    boolean is_find = FALSE;
-
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_data_blks); byte_cursor++)                            /* 调整inodemap */
-    {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if (dno_cursor == dno) {
-                    newfs_super.map_data[byte_cursor] &= (uint8_t)(~(0x1 << bit_cursor));
-                    is_find = TRUE;
-                    break;
+    if (newfs_bitmap_free(&newfs_super.bm_data, dno) != NEWFS_ERROR_NONE) return -1;
+    newfs_cache_forget(NEWFS_DATA_OFS(dno) / NEWFS_BLK_SZ());
+    return newfs_driver_discard(NEWFS_DATA_OFS(dno), NEWFS_BLK_SZ());
+}
+/**
+ * @brief 立即释放一组数据块，丢弃其缓存并通知设备，相邻的块合并为一次discard
+ * 
+ * @param dnos 数据块号，小于0的项跳过
+ * @param cnt 
+ */
+void newfs_free_data_list(const int* dnos, int cnt) {
+    int i, dno, run_start = -1, run_len = 0;
+
+    for (i = 0; i <= cnt; i++) {
+        dno = i < cnt ? dnos[i] : -1;
+        if (dno >= 0 && newfs_bitmap_free(&newfs_super.bm_data, dno) == NEWFS_ERROR_NONE) {
+            newfs_cache_forget(NEWFS_DATA_OFS(dno) / NEWFS_BLK_SZ());
+            if (run_len > 0 && dno == run_start + run_len) {
+                run_len++;
+                continue;
             }
-            dno_cursor++;
         }
-        if (is_find == TRUE) {
-            break;
+        else {
+            dno = -1;
+        }
+        if (run_len > 0) {
+            newfs_driver_discard(NEWFS_DATA_OFS(run_start), NEWFS_BLKS_SZ(run_len));
         }
+        run_start = dno;
+        run_len   = dno >= 0 ? 1 : 0;
+    }
+}
+/**
+ * @brief 释放inode占用的全部数据块，推迟到目录树的修改落盘之后
+ * 
+ * @param inode 
+ */
+void newfs_free_data_blks(struct newfs_inode * inode) {
+    int i;
+
+    for (i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        if (inode->blk_pointer[i] >= 0) {
+            newfs_defer_free(inode->blk_pointer[i]);
+        }
+    }
+    memset(inode->blk_pointer, -1, sizeof(inode->blk_pointer));
+}
+/**
+ * @brief 使inode恰好占用blks个数据块：已有的块原地保留，不足时补充分配，多余的推迟释放
+ * 
+ * @param inode 
+ * @param blks 
+ * @return int 
+ */
+static int newfs_fit_data_blks(struct newfs_inode * inode, int blks) {
+    int have = 0, i;
+
+    if (blks > NEWFS_DATA_PER_FILE) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    while (have < NEWFS_DATA_PER_FILE && inode->blk_pointer[have] >= 0) {
+        have++;
+    }
+    if (have == blks) {
+        return NEWFS_ERROR_NONE;
     }
+    if (have < blks &&                                /* 尽量连续分配，调度器可合并为一次写 */
+        newfs_alloc_data_blks(blks - have, inode->blk_pointer + have) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_NOSPACE;                  /* 一块也不分配，inode保持原样 */
+    }
+    for (i = blks; i < have; i++) {                   /* 磁盘上的旧inode还指向它们，落盘后再释放 */
+        newfs_defer_free(inode->blk_pointer[i]);
+        inode->blk_pointer[i] = -1;
+    }
+    inode->flags |= NEWFS_FLAG_INODE_DIRTY;
     return NEWFS_ERROR_NONE;
 }
+/**
+ * @brief 将inode的脏部分写回块缓存，不递归处理子inode
+ * 
+ * 数据脏时按当前大小增减数据块，已有的块原地复用，再重写目录项或文件内容；
+ * 数据块有增减或inode本身脏时重写newfs_inode_d
+ * 
+ * @param inode 
+ * @return int 
+ */
 
 int newfs_sync_inode(struct newfs_inode * inode) {
     struct newfs_inode_d  inode_d;
     struct newfs_dentry*  dentry_cursor;
-    struct newfs_dentry_d dentry_d;
-    int ino             = inode->ino;
-    inode_d.ino         = ino;
-    inode_d.size        = inode->size;
-    // memcpy(inode_d.target_path, inode->fname, NEWFS_MAX_FILE_NAME);
-    inode_d.ftype       = inode->dentry->ftype;
-    inode_d.dir_cnt     = inode->dir_cnt;
-    int offset;
-    int data_blk_num = 0;
-
-    /* 再写inode下方的数据 */
-    if (NEWFS_IS_DIR(inode)) { /* 如果当前inode是目录，那么数据是目录项，且目录项的inode也要写回 */                          
-        dentry_cursor = inode->dentrys;
-        if (dentry_cursor != NULL) {
-            if ((inode_d.blk_pointer[data_blk_num++] = newfs_alloc_data_blk()) == -NEWFS_ERROR_NOSPACE) return -NEWFS_ERROR_NOSPACE;
-            offset = NEWFS_DATA_OFS(inode_d.blk_pointer[data_blk_num-1]);
-        }
-        int cnt = 0;
-        while (dentry_cursor != NULL)
-        {
+    struct newfs_dentry_d* dentry_d;
+    int      per_blk = NEWFS_DENTRY_PER_BLK();
+    int      i, blks, size;
+    uint8_t* data_ptr;
+    uint8_t* blk_buf;
 
-            memcpy(dentry_d.fname, dentry_cursor->fname, NEWFS_MAX_FILE_NAME);
-            dentry_d.ftype = dentry_cursor->ftype;
-            dentry_d.ino = dentry_cursor->ino;
-            if (newfs_driver_write(offset, (uint8_t *)&dentry_d, 
-                                 sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE) {
+    if (inode->flags & NEWFS_FLAG_DATA_DIRTY) {
+        if (NEWFS_IS_DIR(inode)) {
+            blks = NEWFS_ROUND_UP(inode->dir_cnt, per_blk) / per_blk;
+        }
+        else {
+            blks = NEWFS_ROUND_UP(inode->size, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ();
+        }
+        if (newfs_fit_data_blks(inode, blks) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+    }
+    if ((inode->flags & NEWFS_FLAG_DATA_DIRTY) && NEWFS_IS_DIR(inode)) {   /* 目录的数据是目录项 */
+        blk_buf       = newfs_arena_alloc(NEWFS_BLK_SZ());
+        if (blk_buf == NULL) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        dentry_cursor = inode->dentrys;
+        for (blks = 0; dentry_cursor != NULL; blks++) {  /* 在内存中拼好整块，每块写一次 */
+            memset(blk_buf, 0, NEWFS_BLK_SZ());
+            dentry_d = (struct newfs_dentry_d *)blk_buf;
+            for (i = 0; i < per_blk && dentry_cursor != NULL; i++, dentry_cursor = dentry_cursor->brother) {
+                memcpy(dentry_d[i].fname, dentry_cursor->fname, NEWFS_MAX_FILE_NAME);
+                dentry_d[i].ftype = dentry_cursor->ftype;
+                dentry_d[i].ino   = dentry_cursor->ino;
+            }
+            if (newfs_cache_write(NEWFS_DATA_OFS(inode->blk_pointer[blks]), blk_buf, 
+                                  NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
                 NEWFS_DBG("[%s] io error\n", __func__);
+                newfs_arena_free(blk_buf, NEWFS_BLK_SZ());
                 return -NEWFS_ERROR_IO;                     
             }
-            
-            if (dentry_cursor->inode != NULL) {
-                newfs_sync_inode(dentry_cursor->inode);
-            }
-
-            dentry_cursor = dentry_cursor->brother;
-            offset += sizeof(struct newfs_dentry_d);
-            cnt++;
-            // 如果已经填满了一个逻辑块，需要重新分配
-            if (cnt * sizeof(struct newfs_dentry_d) >= NEWFS_BLK_SZ()) {
-                inode_d.blk_pointer[data_blk_num++] = newfs_alloc_data_blk();
-                offset = NEWFS_DATA_OFS(inode_d.blk_pointer[data_blk_num-1]);
-            }
         }
-    }
-    else if (NEWFS_IS_REG(inode)) { /* 如果当前inode是文件，那么数据是文件内容，直接写即可 */
-        int size = inode->size;
-        uint8_t* data_ptr = inode -> data;
-       
-        while (size > 0) {
-            if ((inode_d.blk_pointer[data_blk_num++] = newfs_alloc_data_blk()) == -NEWFS_ERROR_NOSPACE) return -NEWFS_ERROR_NOSPACE;
-            
-            if (newfs_driver_write(NEWFS_DATA_OFS(inode_d.blk_pointer[data_blk_num - 1]), inode->data, 
-                                NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+        newfs_arena_free(blk_buf, NEWFS_BLK_SZ());
+    }
+    else if (inode->flags & NEWFS_FLAG_DATA_DIRTY) {  /* 文件的数据是文件内容 */
+        size     = inode->size;
+        data_ptr = inode->data;
+        for (i = 0; i < NEWFS_DATA_PER_FILE && inode->blk_pointer[i] >= 0; i++) {
+            if (newfs_cache_write(NEWFS_DATA_OFS(inode->blk_pointer[i]), data_ptr, 
+                                  size > NEWFS_BLK_SZ() ? NEWFS_BLK_SZ() : size) != NEWFS_ERROR_NONE) {
                 NEWFS_DBG("[%s] io error\n", __func__);
                 return -NEWFS_ERROR_IO;
             }
-            size -= newfs_super.sz_blk;
-            data_ptr += newfs_super.sz_blk;
-            
-            if (data_blk_num > NEWFS_DATA_PER_FILE) break;
-        }  
+            size     -= NEWFS_BLK_SZ();
+            data_ptr += NEWFS_BLK_SZ();
+        }
     }
-    if(data_blk_num < NEWFS_DATA_PER_FILE) inode_d.blk_pointer[data_blk_num] = -1;
 
-        /* 先写inode本身 */
-    if (newfs_driver_write(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                     sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE) {
-        NEWFS_DBG("[%s] io error\n", __func__);
-        return -NEWFS_ERROR_IO;
+    if (inode->flags & NEWFS_FLAG_INODE_DIRTY) {
+        memset(&inode_d, 0, sizeof(struct newfs_inode_d));
+        inode_d.ino     = inode->ino;
+        inode_d.size    = inode->size;
+        inode_d.ftype   = inode->dentry->ftype;
+        inode_d.dir_cnt = inode->dir_cnt;
+        memcpy(inode_d.blk_pointer, inode->blk_pointer, sizeof(inode_d.blk_pointer));
+        if (newfs_cache_write(NEWFS_INO_OFS(inode->ino), (uint8_t *)&inode_d, 
+                              sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE) {
+            NEWFS_DBG("[%s] io error\n", __func__);
+            return -NEWFS_ERROR_IO;
+        }
     }
     return NEWFS_ERROR_NONE;
 }
@@ -369,43 +474,27 @@ int newfs_drop_inode(struct newfs_inode * inode) {
     struct newfs_dentry*  dentry_to_free;
     struct newfs_inode*   inode_cursor;
 
-    int byte_cursor = 0; 
-    int bit_cursor  = 0; 
-    int ino_cursor  = 0;
-    boolean is_find = FALSE;
-
     if (inode == newfs_super.root_dentry->inode) {
         return NEWFS_ERROR_INVAL;
     }
 
-    // 删除索引位图的值
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_inode_blks); byte_cursor++)                            /* 调整inodemap */
-    {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if (ino_cursor == inode->ino) {
-                    newfs_super.map_inode[byte_cursor] &= (uint8_t)(~(0x1 << bit_cursor));
-                    is_find = TRUE;
-                    break;
-            }
-            ino_cursor++;
-        }
-        if (is_find == TRUE) {
-            break;
-        }
-    }
+    newfs_bitmap_free(&newfs_super.bm_inode, inode->ino);   /* 删除索引位图的值 */
+    newfs_free_data_blks(inode);                      /* 释放数据块 */
+    newfs_clear_dirty(inode);                         /* 已不在磁盘上，无需写回 */
 
     if (NEWFS_IS_DIR(inode)) {
         dentry_cursor = inode->dentrys;
-                                                      /* 递归向下drop */
+                                                      /* 递归向下drop，不经newfs_drop_dentry，以免重新标脏 */
         while (dentry_cursor)
         {   
             inode_cursor = dentry_cursor->inode;
             newfs_drop_inode(inode_cursor);
-            newfs_drop_dentry(inode, dentry_cursor);
             dentry_to_free = dentry_cursor;
             dentry_cursor = dentry_cursor->brother;
             free(dentry_to_free);
         }
+        inode->dentrys = NULL;
+        inode->dir_cnt = 0;
     }
     else if (NEWFS_IS_REG(inode)) {
 
@@ -415,6 +504,25 @@ int newfs_drop_inode(struct newfs_inode * inode) {
     }
     return NEWFS_ERROR_NONE;
 }
+/**
+ * @brief 读inode出错时释放已读入的部分：子目录项、文件数据和inode本身
+ *
+ * @param inode
+ */
+static void newfs_free_partial_inode(struct newfs_inode* inode) {
+    struct newfs_dentry* dentry_cursor = inode->dentrys;
+    struct newfs_dentry* dentry_to_free;
+
+    newfs_clear_dirty(inode);
+    while (dentry_cursor) {
+        dentry_to_free = dentry_cursor;
+        dentry_cursor  = dentry_cursor->brother;
+        free(dentry_to_free);
+    }
+    if (inode->data)
+        free(inode->data);
+    free(inode);
+}
 /**
  * @brief 
  * 
@@ -424,53 +532,85 @@ int newfs_drop_inode(struct newfs_inode * inode) {
  */
 struct newfs_inode* newfs_read_inode(struct newfs_dentry * dentry, int ino) {
     struct newfs_inode* inode = (struct newfs_inode*)malloc(sizeof(struct newfs_inode));
-    struct newfs_inode_d inode_d;
+    const struct newfs_inode_d*  inode_d;
+    const struct newfs_dentry_d* dentry_d;
+    struct newfs_inode_d  inode_copy;                 /* 无法原地访问时的读入位置 */
+    uint8_t* blk_copy;
+    uint64_t* ino_blks;
     struct newfs_dentry* sub_dentry;
-    struct newfs_dentry_d dentry_d;
-    int    dir_cnt = 0, i;
-    /* 从磁盘读索引结点 */
-    if (newfs_driver_read(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d, 
-                        sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE) {
+    int    dir_cnt = 0, i, j, blk;
+    /* 从磁盘读索引结点，尽量原地访问 */
+    inode_d = (const struct newfs_inode_d *)newfs_cache_view(NEWFS_INO_OFS(ino), 
+                        (uint8_t *)&inode_copy, sizeof(struct newfs_inode_d));
+    if (inode_d == NULL) {
         NEWFS_DBG("[%s] io error\n", __func__);
+        free(inode);
         return NULL;                    
     }
     inode->dir_cnt = 0;
-    inode->ino = inode_d.ino;
-    inode->size = inode_d.size;
+    inode->ino = inode_d->ino;
+    inode->size = inode_d->size;
     // memcpy(inode->fname, inode_d.target_path, NEWFS_MAX_FILE_NAME);
     inode->dentry = dentry;
     inode->dentrys = NULL;
+    inode->data = NULL;
+    inode->flags = 0;
+    inode->dirty_next = NULL;
+    memset(inode->blk_pointer, -1, sizeof(inode->blk_pointer));
+    for (i = 0; i < NEWFS_DATA_PER_FILE && inode_d->blk_pointer[i] != -1; i++) {
+        inode->blk_pointer[i] = inode_d->blk_pointer[i];
+    }
+    dir_cnt = inode_d->dir_cnt;                       /* 此后inode_d可能失效 */
     /* 内存中的inode的数据或子目录项部分也需要读出 */
     if (NEWFS_IS_DIR(inode)) {
-        dir_cnt = inode_d.dir_cnt;
-        int data_blk_num = 0, cnt = 0;
-        for (i = 0; i < dir_cnt; i++,cnt++)
-        {
-            if (cnt * sizeof(struct newfs_dentry_d) >= NEWFS_BLK_SZ()) {
-               if (data_blk_num > NEWFS_DATA_PER_FILE) return NULL;
-               data_blk_num++;
-               cnt = 0;
-            }
-            if (newfs_driver_read(NEWFS_DATA_OFS(inode_d.blk_pointer[data_blk_num]) + cnt * sizeof(struct newfs_dentry_d), 
-                                (uint8_t *)&dentry_d, 
-                                sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE) {
+        blk_copy = newfs_arena_alloc(NEWFS_BLK_SZ());
+        if (blk_copy == NULL) {
+            newfs_free_partial_inode(inode);
+            return NULL;
+        }
+        for (i = 0, blk = 0; i < dir_cnt && blk < NEWFS_DATA_PER_FILE && 
+                             inode->blk_pointer[blk] >= 0; blk++) {   /* 每个目录块只读一次 */
+            dentry_d = (const struct newfs_dentry_d *)newfs_cache_view(
+                                NEWFS_DATA_OFS(inode->blk_pointer[blk]), blk_copy, NEWFS_BLK_SZ());
+            if (dentry_d == NULL) {
                 NEWFS_DBG("[%s] io error\n", __func__);
-                return NULL;
+                break;
             }
-            sub_dentry = new_dentry(dentry_d.fname, dentry_d.ftype);
-            sub_dentry->parent = inode->dentry;
-            sub_dentry->ino    = dentry_d.ino; 
-            newfs_alloc_dentry(inode, sub_dentry);
+            for (j = 0; j < NEWFS_DENTRY_PER_BLK() && i < dir_cnt; j++, i++) {
+                sub_dentry = new_dentry((char *)dentry_d[j].fname, dentry_d[j].ftype);
+                sub_dentry->parent = inode->dentry;
+                sub_dentry->ino    = dentry_d[j].ino; 
+                newfs_alloc_dentry(inode, sub_dentry);
+            }
+        }
+        newfs_arena_free(blk_copy, NEWFS_BLK_SZ());
+        newfs_clear_dirty(inode);                     /* 从磁盘读出目录项不算修改 */
+        if (i < dir_cnt) {
+            newfs_free_partial_inode(inode);
+            return NULL;
+        }
+        if (dir_cnt > 0) {                            /* 子inode接下来多半会被访问，一批读入它们所在的inode块 */
+            ino_blks = (uint64_t *)malloc(2 * dir_cnt * sizeof(uint64_t));
+            for (i = 0, sub_dentry = inode->dentrys; sub_dentry != NULL; sub_dentry = sub_dentry->brother) {
+                ino_blks[i++] = NEWFS_INO_OFS(sub_dentry->ino) / NEWFS_BLK_SZ();
+                if ((NEWFS_INO_OFS(sub_dentry->ino + 1) - 1) / NEWFS_BLK_SZ() != ino_blks[i - 1]) {
+                    ino_blks[i] = ino_blks[i - 1] + 1;    /* newfs_inode_d跨块 */
+                    i++;
+                }
+            }
+            newfs_cache_prefetch(ino_blks, i);
+            free(ino_blks);
         }
     }
     else if (NEWFS_IS_REG(inode)) {
-        inode->data = (uint8_t *)malloc(sizeof(uint8_t) * inode_d.size);
+        inode->data = (uint8_t *)malloc(sizeof(uint8_t) * inode->size);
         uint8_t* data_ptr = inode->data;
-        int size = inode_d.size;
-        for (int i=0;inode_d.blk_pointer[i]!=-1&&i<NEWFS_DATA_PER_FILE;i++){
-            if (newfs_driver_read(NEWFS_DATA_OFS(ino), data_ptr, 
-                                size > NEWFS_BLK_SZ()? NEWFS_BLK_SZ() : inode_d.size) != NEWFS_ERROR_NONE) {
+        int size = inode->size;
+        for (int i=0;i<NEWFS_DATA_PER_FILE&&inode->blk_pointer[i]!=-1;i++){
+            if (newfs_cache_read(NEWFS_DATA_OFS(inode->blk_pointer[i]), data_ptr, 
+                                size > NEWFS_BLK_SZ()? NEWFS_BLK_SZ() : size) != NEWFS_ERROR_NONE) {
                 NEWFS_DBG("[%s] io error\n", __func__);
+                newfs_free_partial_inode(inode);
                 return NULL;                    
             }
             size -= NEWFS_BLK_SZ();
@@ -533,7 +673,7 @@ struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean*
     int   lvl = 0;
     boolean is_hit;
     char* fname = NULL;
-    char* path_cpy = (char*)malloc(sizeof(path));
+    char* path_cpy = (char*)malloc(strlen(path) + 1);
     *is_root = FALSE;
     strcpy(path_cpy, path);
 
@@ -547,7 +687,7 @@ struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean*
     {   
         lvl++;
         if (dentry_cursor->inode == NULL) {           /* Cache机制 */
-            newfs_read_inode(dentry_cursor, dentry_cursor->ino);
+            dentry_cursor->inode = newfs_read_inode(dentry_cursor, dentry_cursor->ino);
         }
 
         inode = dentry_cursor->inode;
@@ -589,6 +729,7 @@ struct newfs_dentry* newfs_lookup(const char * path, boolean* is_find, boolean*
     if (dentry_ret->inode == NULL) {
         dentry_ret->inode = newfs_read_inode(dentry_ret, dentry_ret->ino);
     }
+    free(path_cpy);
     
     return dentry_ret;
 }
@@ -612,12 +753,24 @@ int newfs_mount(struct custom_options options){
     struct newfs_inode*   root_inode;
 
     int                 inode_num;
-    int                 map_inode_blks=1;
+    int                 sz_disk;
+    struct ddriver_geometry geometry;
+    uint64_t            tot_blks, free_blks;
+    int                 inode_per_blk, bits_per_blk;
     
-    int                 super_blks;
+    int                 super_blks, journal_blks;
     boolean             is_init = FALSE;
+    pthread_mutexattr_t attr;
 
     newfs_super.is_mounted = FALSE;
+    newfs_super.io_rmw_read  = 0;
+    newfs_super.io_rmw_saved = 0;
+
+    pthread_mutex_init(&newfs_super.lock, NULL);
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);  /* 写回线程持有时还会经newfs_driver_write再取 */
+    pthread_mutex_init(&newfs_super.io_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 
     // driver_fd = open(options.device, O_RDWR);
     driver_fd = ddriver_open(options.device);
@@ -627,41 +780,63 @@ int newfs_mount(struct custom_options options){
     }
 
     newfs_super.driver_fd = driver_fd;
-    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE,  &newfs_super.sz_disk);
+    memset(&geometry, 0, sizeof(struct ddriver_geometry));
+    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_GEOMETRY, &geometry);
     ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &newfs_super.sz_io);
+    if (geometry.disk_size != 0) {
+        newfs_super.sz_disk = geometry.disk_size;
+    }
+    else {                                            /* 旧驱动不支持GEOMETRY */
+        ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE, &sz_disk);
+        newfs_super.sz_disk = (uint64_t)(unsigned int)sz_disk;
+    }
     newfs_super.sz_blk = newfs_super.sz_io << 1;
+    newfs_cache_init(options.cache_kb > 0 ? options.cache_kb : NEWFS_CACHE_DEFAULT_KB);
 
     
     root_dentry = new_dentry("/", NEWFS_DIR);     /* 根目录项每次挂载时新建 */
 
-    if (newfs_driver_read(NEWFS_SUPER_OFS, (uint8_t *)(&newfs_super_d), 
+    if (newfs_cache_read(NEWFS_SUPER_OFS, (uint8_t *)(&newfs_super_d), 
                         sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
         return -NEWFS_ERROR_IO;
     }   
                                                       /* 读取super */
     if (newfs_super_d.magic_num != NEWFS_MAGIC_NUM) {     /* 幻数不正确，初始化 */
-                                                      /* 估算各部分大小 */
-        super_blks = NEWFS_ROUND_UP(sizeof(struct newfs_super_d), NEWFS_BLK_SZ()) / NEWFS_BLK_SZ();
-        int tot_num = newfs_super.sz_disk / newfs_super.sz_blk;
-
-        // max_inode估算
-        int max_ino = (tot_num - 1 - 1 - super_blks) / (NEWFS_DATA_PER_FILE + 1);
-        int inode_per_blk = NEWFS_BLK_SZ() / sizeof(struct newfs_inode_d);
-        newfs_super_d.max_ino = NEWFS_ROUND_UP(max_ino, inode_per_blk);
-
+                                                      /* 按设备大小估算各部分大小 */
+        super_blks    = NEWFS_ROUND_UP(sizeof(struct newfs_super_d), NEWFS_BLK_SZ()) / NEWFS_BLK_SZ();
+        tot_blks      = NEWFS_DISK_SZ() / NEWFS_BLK_SZ();
+        inode_per_blk = NEWFS_BLK_SZ() / sizeof(struct newfs_inode_d);
+        bits_per_blk  = NEWFS_BLK_SZ() * UINT8_BITS;
+
+        // 日志区最多占设备的1/16
+        journal_blks  = tot_blks / 16 < NEWFS_JOURNAL_BLKS ? tot_blks / 16 : NEWFS_JOURNAL_BLKS;
+        journal_blks  = journal_blks < NEWFS_JOURNAL_MIN_BLKS ? 0 : journal_blks;
+        super_blks   += journal_blks;
+
+        // max_inode估算：每个文件平均占用NEWFS_DATA_PER_FILE个数据块
+        free_blks = tot_blks - super_blks - NEWFS_INODE_MAP_BLKS - NEWFS_DATA_MAP_BLKS;
+        newfs_super_d.max_ino        = NEWFS_ROUND_UP(free_blks / (NEWFS_DATA_PER_FILE + 1),
+                                                      (uint64_t)inode_per_blk);
+        newfs_super_d.map_inode_blks = NEWFS_ROUND_UP(newfs_super_d.max_ino, bits_per_blk) / bits_per_blk;
+        newfs_super_d.inode_per_blk  = inode_per_blk;
+        newfs_super_d.inode_blks     = newfs_super_d.max_ino / inode_per_blk;
+
+        // 剩余空间由数据位图和数据块分享，每个位图块管理bits_per_blk个数据块
+        free_blks = tot_blks - super_blks - newfs_super_d.map_inode_blks - newfs_super_d.inode_blks;
+        newfs_super_d.map_data_blks  = NEWFS_ROUND_UP(free_blks, (uint64_t)bits_per_blk + 1) / (bits_per_blk + 1);
+        newfs_super_d.max_dno        = free_blks - newfs_super_d.map_data_blks;
+
+        newfs_super_d.journal_offset   = NEWFS_SUPER_OFS + NEWFS_BLKS_SZ(super_blks - journal_blks);
+        newfs_super_d.journal_blks     = journal_blks;
         newfs_super_d.map_inode_offset = NEWFS_SUPER_OFS + NEWFS_BLKS_SZ(super_blks);
-        newfs_super_d.map_data_offset = newfs_super_d.map_inode_offset + NEWFS_BLKS_SZ(map_inode_blks);
-        newfs_super_d.map_inode_blks  = map_inode_blks;
-        newfs_super_d.map_data_blks = 1;
-        newfs_super.map_inode_blks = 1;
-        newfs_super_d.inode_offset = newfs_super_d.map_data_offset + NEWFS_BLK_SZ();
-        newfs_super_d.data_offset = newfs_super_d.inode_offset + newfs_super_d.max_ino/inode_per_blk * NEWFS_BLK_SZ();
-        newfs_super_d.inode_per_blk = inode_per_blk;
-        newfs_super_d.inode_blks = (newfs_super_d.max_ino/inode_per_blk);
-        newfs_super_d.max_dno =(tot_num - 3 - newfs_super_d.inode_blks);
+        newfs_super_d.map_data_offset  = newfs_super_d.map_inode_offset + NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks);
+        newfs_super_d.inode_offset     = newfs_super_d.map_data_offset + NEWFS_BLKS_SZ(newfs_super_d.map_data_blks);
+        newfs_super_d.data_offset      = newfs_super_d.inode_offset + NEWFS_BLKS_SZ(newfs_super_d.inode_blks);
 
         newfs_super_d.sz_usage    = 0;
-        NEWFS_DBG("inode map blocks: %d\n", map_inode_blks);
+        NEWFS_DBG("journal blocks: %d, inode map blocks: %d, data map blocks: %d, inode blocks: %d\n",
+                  newfs_super_d.journal_blks, newfs_super_d.map_inode_blks, 
+                  newfs_super_d.map_data_blks, newfs_super_d.inode_blks);
         is_init = TRUE;
     }
     newfs_super.sz_usage   = newfs_super_d.sz_usage;      /* 建立 in-memory 结构 */
@@ -678,24 +853,43 @@ int newfs_mount(struct custom_options options){
     newfs_super.inode_blks = newfs_super_d.inode_blks;
     newfs_super.inode_offset = newfs_super_d.inode_offset;
     newfs_super.data_offset = newfs_super_d.data_offset;
+    newfs_super.journal_offset = newfs_super_d.journal_offset;
+    newfs_super.journal_blks = newfs_super_d.journal_blks;
 
 	printf("\n--------------------------------------------------------------------------------\n\n");
 
-    if (newfs_driver_read(newfs_super_d.map_inode_offset, (uint8_t *)(newfs_super.map_inode), 
+    if (newfs_journal_init(is_init) != NEWFS_ERROR_NONE) {     /* 重放日志，之后再读元数据 */
+        return -NEWFS_ERROR_IO;
+    }
+    if (newfs_cache_read(newfs_super_d.map_inode_offset, (uint8_t *)(newfs_super.map_inode), 
                         NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks)) != NEWFS_ERROR_NONE) {
         return -NEWFS_ERROR_IO;
     }
-    if (newfs_driver_read(newfs_super_d.map_data_offset, (uint8_t *)(newfs_super.map_data), 
+    if (newfs_cache_read(newfs_super_d.map_data_offset, (uint8_t *)(newfs_super.map_data), 
                         NEWFS_BLKS_SZ(newfs_super_d.map_data_blks)) != NEWFS_ERROR_NONE) {
         return -NEWFS_ERROR_IO;
     }
+    newfs_bitmap_init(&newfs_super.bm_inode, newfs_super.map_inode, newfs_super.max_ino);
+    newfs_bitmap_init(&newfs_super.bm_data, newfs_super.map_data, newfs_super.max_dno);
 
     if (is_init) {                                    /* 分配根节点 */
         root_inode = newfs_alloc_inode(root_dentry);
-        newfs_sync_inode(root_inode);
+        if (newfs_writeback() != NEWFS_ERROR_NONE) {  /* 写回根节点和位图 */
+            return -NEWFS_ERROR_IO;
+        }
+        free(root_inode);                             /* 下面重新从磁盘读出 */
+        newfs_super_d.magic_num = NEWFS_MAGIC_NUM;    /* 格式化立即落盘，之后的修改经日志提交 */
+        if (newfs_cache_write(NEWFS_SUPER_OFS, (uint8_t *)&newfs_super_d, 
+                              sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE ||
+            newfs_cache_sync() != NEWFS_ERROR_NONE || newfs_driver_flush() != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
     }
     
     root_inode            = newfs_read_inode(root_dentry, NEWFS_ROOT_INO);  /* 读取根目录 */
+    if (root_inode == NULL) {
+        return -NEWFS_ERROR_IO;
+    }
     root_dentry->inode    = root_inode;
     newfs_super.root_dentry = root_dentry;
     newfs_super.is_mounted  = TRUE;
@@ -713,8 +907,50 @@ int newfs_mount(struct custom_options options){
         }
         printf("\n");
     }
+
+    if (newfs_flusher_start(options.flush_age_ms, options.dirty_kb) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
     return ret;
 }
+/**
+ * @brief 打印设备IO统计、设备模型耗时，以及写路径因对齐而省去的预读
+ */
+void newfs_dump_io_stat() {
+    struct ddriver_state_ext state;
+    struct ddriver_stats     stats;
+    memset(&state, 0, sizeof(struct ddriver_state_ext));
+    memset(&stats, 0, sizeof(struct ddriver_stats));
+    stats.size = sizeof(struct ddriver_stats);
+    ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_STATE_EXT, &state);
+    if (state.read_cnt + state.write_cnt + state.seek_cnt == 0) {   /* 旧驱动不支持STATE_EXT */
+        ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_STATE, &state);
+    }
+    NEWFS_DBG("[%s] device read %d, write %d, seek %d; "
+              "write pre-read units %d, saved %d\n", __func__,
+              state.read_cnt, state.write_cnt, state.seek_cnt,
+              newfs_super.io_rmw_read, newfs_super.io_rmw_saved);
+    NEWFS_DBG("[%s] modeled time %lluus (seek %lluus); "
+              "read p50/p99/max %llu/%llu/%lluus, write p50/p99/max %llu/%llu/%lluus\n", __func__,
+              state.clock_us, state.seek_us,
+              state.read.p50_us, state.read.p99_us, state.read.max_us,
+              state.write.p50_us, state.write.p99_us, state.write.max_us);
+    if (ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_STATS, &stats) == 0 && 
+        stats.version >= 1) {
+        NEWFS_DBG("[%s] device read %llu bytes, write %llu bytes, discard %llu bytes, "
+                  "flush %llu, queue depth hwm %d\n", __func__, stats.read_bytes, stats.write_bytes, 
+                  stats.version >= 2 ? stats.discard_bytes : 0, 
+                  stats.version >= 3 ? stats.flush_cnt : 0, stats.queue_depth_hwm);
+    }
+    if (stats.version >= 4) {
+        NEWFS_DBG("[%s] read p999 %lluus, write p999 %lluus; injected %llu stalls, %llu EIO\n", __func__,
+                  stats.read_p999_us, stats.write_p999_us, stats.stall_cnt, stats.eio_cnt);
+    }
+    NEWFS_DBG("[%s] background writeback: %d by age, %d by pressure, %d by fsync, %llu blocks\n", 
+              __func__, newfs_super.flush_age_cnt, newfs_super.flush_pressure_cnt, 
+              newfs_super.flush_sync_cnt, (unsigned long long)newfs_super.flush_blks);
+    newfs_journal_dump_stat();
+}
 /**
  * @brief 
  * 
@@ -722,12 +958,16 @@ int newfs_mount(struct custom_options options){
  */
 int newfs_umount() {
     struct newfs_super_d  newfs_super_d; 
+    int                   ret = NEWFS_ERROR_NONE;
 
     if (!newfs_super.is_mounted) {
         return NEWFS_ERROR_NONE;
     }
 
-    newfs_sync_inode(newfs_super.root_dentry->inode);     /* 从根节点向下刷写节点 */
+    newfs_flusher_stop();                             /* 此后只有本线程访问 */
+    if (newfs_writeback_final() != NEWFS_ERROR_NONE) {    /* 只写回脏inode和位图的修改 */
+        ret = -NEWFS_ERROR_IO;
+    }
                                                     
     newfs_super_d.magic_num           = NEWFS_MAGIC_NUM;
     newfs_super_d.map_inode_blks      = newfs_super.map_inode_blks;
@@ -741,24 +981,38 @@ int newfs_umount() {
     newfs_super_d.inode_per_blk       = newfs_super.inode_per_blk;
     newfs_super_d.inode_blks          = newfs_super.inode_blks;
     newfs_super_d.sz_usage            = newfs_super.sz_usage;
+    newfs_super_d.journal_offset      = newfs_super.journal_offset;
+    newfs_super_d.journal_blks        = newfs_super.journal_blks;
 
-    if (newfs_driver_write(NEWFS_SUPER_OFS, (uint8_t *)&newfs_super_d, 
-                     sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    if ((ret == NEWFS_ERROR_NONE || newfs_super.journal_blks == 0) &&   /* 有日志时其中可能有旧版本，不能绕过它原地写 */
+        (newfs_cache_write(NEWFS_SUPER_OFS, (uint8_t *)&newfs_super_d, 
+                           sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE ||
+         newfs_cache_sync() != NEWFS_ERROR_NONE)) {
+        ret = -NEWFS_ERROR_IO;
     }
-
-    if (newfs_driver_write(newfs_super_d.map_inode_offset, (uint8_t *)(newfs_super.map_inode), 
-                         NEWFS_BLKS_SZ(newfs_super_d.map_inode_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    pthread_mutex_lock(&newfs_super.io_lock);
+    if (newfs_sched_drain() != NEWFS_ERROR_NONE) {    /* 出错时也不能把写留在调度队列里 */
+        ret = -NEWFS_ERROR_IO;
     }
-
-    if (newfs_driver_write(newfs_super_d.map_data_offset, (uint8_t *)(newfs_super.map_data), 
-                         NEWFS_BLKS_SZ(newfs_super_d.map_data_blks)) != NEWFS_ERROR_NONE) {
-        return -NEWFS_ERROR_IO;
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    if (newfs_driver_flush() != NEWFS_ERROR_NONE) {   /* 确认全部写回已落盘 */
+        ret = -NEWFS_ERROR_IO;
+    }
+    if (ret != NEWFS_ERROR_NONE) {
+        return ret;
     }
+    newfs_journal_destroy();
+    newfs_cache_destroy();
+    newfs_dump_io_stat();
     free(newfs_super.map_inode);
     free(newfs_super.map_data);
+    free(newfs_super.free_defer);
+    newfs_super.free_defer     = NULL;
+    newfs_super.free_defer_cnt = 0;
+    newfs_super.free_defer_cap = 0;
     ddriver_close(NEWFS_DRIVER());
+    pthread_mutex_destroy(&newfs_super.io_lock);
+    pthread_mutex_destroy(&newfs_super.lock);
 
     return NEWFS_ERROR_NONE;
 }
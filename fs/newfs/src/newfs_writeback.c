@@ -0,0 +1,359 @@
+#include "../include/newfs.h"
+#include <time.h>
+extern struct newfs_super      newfs_super;
+
+static uint64_t newfs_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/******************************************************************************
+* SECTION: 增量写回
+*
+* 修改内存中的目录树时只给涉及的inode打脏标记并挂入脏链表：新建的inode两种标记都有，
+* 增删目录项的目录标记目录项和inode本身。写回时逐个处理脏inode，已占用的数据块原地
+* 复用，再写回位图中被修改过的块。一次写回的代价只与修改量有关，与目录树大小无关。
+*******************************************************************************/
+/**
+ * @brief 给inode打上脏标记，第一次变脏时挂入脏链表
+ *
+ * @param inode
+ * @param flags NEWFS_FLAG_INODE_DIRTY / NEWFS_FLAG_DATA_DIRTY
+ */
+void newfs_mark_dirty(struct newfs_inode* inode, flag16 flags) {
+    if (inode->flags == 0) {
+        inode->dirty_next       = newfs_super.dirty_list;
+        newfs_super.dirty_list  = inode;
+        newfs_super.dirty_cnt++;
+    }
+    inode->flags |= flags;
+    if (newfs_super.dirty_since_ms == 0) {
+        newfs_super.dirty_since_ms = newfs_now_ms();
+    }
+    if (newfs_super.flusher_running && newfs_dirty_bytes() >= newfs_super.dirty_limit) {
+        pthread_cond_signal(&newfs_super.flush_cond);
+    }
+}
+/**
+ * @brief 不写回，直接清除脏标记并从脏链表中取下，用于inode被释放前
+ *
+ * @param inode
+ */
+void newfs_clear_dirty(struct newfs_inode* inode) {
+    struct newfs_inode** link = &newfs_super.dirty_list;
+
+    if (inode->flags == 0) {
+        return;
+    }
+    while (*link != NULL && *link != inode) {
+        link = &(*link)->dirty_next;
+    }
+    if (*link == inode) {
+        *link = inode->dirty_next;
+        newfs_super.dirty_cnt--;
+    }
+    inode->flags      = 0;
+    inode->dirty_next = NULL;
+}
+static void newfs_defer_append(const int* dnos, int n) {
+    if (newfs_super.free_defer_cnt + n > newfs_super.free_defer_cap) {
+        newfs_super.free_defer_cap = newfs_super.free_defer_cnt + n > newfs_super.free_defer_cap * 2 ?
+                                     newfs_super.free_defer_cnt + n : newfs_super.free_defer_cap * 2;
+        newfs_super.free_defer     = (int *)realloc(newfs_super.free_defer, 
+                                                    newfs_super.free_defer_cap * sizeof(int));
+    }
+    memcpy(newfs_super.free_defer + newfs_super.free_defer_cnt, dnos, n * sizeof(int));
+    newfs_super.free_defer_cnt += n;
+}
+/**
+ * @brief 推迟释放一个数据块，直到不再引用它的inode随一轮写回落盘
+ *
+ * 在那之前磁盘上的旧inode仍指向它，立即释放的话它可能被discard或重新分配后覆盖，
+ * 写回失败或崩溃时文件在磁盘上唯一的副本就没了
+ *
+ * @param dno
+ */
+void newfs_defer_free(int dno) {
+    newfs_defer_append(&dno, 1);
+}
+/**
+ * @brief 写回位图中被修改过的块
+ */
+static int newfs_writeback_bitmap(struct newfs_bitmap* bm, uint8_t* map, uint64_t map_offset) {
+    uint64_t start, end;
+
+    if (!newfs_bitmap_dirty(bm, NEWFS_BLK_SZ(), &start, &end)) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (newfs_cache_write(map_offset + start, map + start, end - start) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    newfs_bitmap_clean(bm);
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 写回全部脏inode和位图的修改，写入块缓存，落盘由调用者sync/flush
+ *
+ * 某个inode写回失败时继续处理其余的inode和位图，失败的inode挂回脏链表尾部，
+ * 不会挡住之后的写回
+ *
+ * @return int 第一个错误
+ */
+int newfs_writeback() {
+    struct newfs_inode*  inode;
+    struct newfs_inode*  failed      = NULL;
+    struct newfs_inode** failed_tail = &failed;
+    struct newfs_inode** link;
+    int ret = NEWFS_ERROR_NONE, err;
+
+    while ((inode = newfs_super.dirty_list) != NULL) {
+        newfs_super.dirty_list = inode->dirty_next;
+        inode->dirty_next      = NULL;
+        err = newfs_sync_inode(inode);                /* 可能分配或释放数据块，先于位图写回 */
+        if (err != NEWFS_ERROR_NONE) {
+            NEWFS_DBG("[%s] sync inode %d error\n", __func__, inode->ino);
+            ret          = ret != NEWFS_ERROR_NONE ? ret : err;
+            *failed_tail = inode;                     /* 仍是脏的，保留标记 */
+            failed_tail  = &inode->dirty_next;
+            continue;
+        }
+        newfs_super.dirty_cnt--;
+        inode->flags = 0;
+    }
+    for (link = &newfs_super.dirty_list; *link != NULL; link = &(*link)->dirty_next)
+        ;
+    *link = failed;
+    if (newfs_writeback_bitmap(&newfs_super.bm_inode, newfs_super.map_inode,
+                               newfs_super.map_inode_offset) != NEWFS_ERROR_NONE ||
+        newfs_writeback_bitmap(&newfs_super.bm_data, newfs_super.map_data,
+                               newfs_super.map_data_offset) != NEWFS_ERROR_NONE) {
+        ret = ret != NEWFS_ERROR_NONE ? ret : -NEWFS_ERROR_IO;
+    }
+    return ret;
+}
+/**
+ * @brief 尚未落盘的数据量估计：每个脏inode和每个脏缓存块各按一块计
+ *
+ * @return uint64_t
+ */
+uint64_t newfs_dirty_bytes() {
+    return (uint64_t)(newfs_super.dirty_cnt + newfs_cache_dirty_cnt()) * NEWFS_BLK_SZ();
+}
+
+/******************************************************************************
+* SECTION: 后台写回线程
+*
+* 修改超过flush_age_ms未写回，或脏数据超过dirty_limit时，写回线程把脏inode和位图
+* 写入块缓存并取出脏块快照，随后只持有io_lock写设备。前台查找只在这段很短的内存
+* 操作期间等待newfs_super.lock，不会因设备IO阻塞，除非它自己缓存不命中要读设备。
+*******************************************************************************/
+/**
+ * @brief 写回一轮，调用时持有newfs_super.lock，返回时仍持有
+ *
+ * 有日志时脏块作为一组事务提交到日志（本身就会落盘），否则直接写回原位
+ *
+ * @param barrier 写出后是否等待落盘
+ * @param background 由写回线程调用，日志较满时顺便做检查点
+ * @return int
+ */
+static int newfs_writeback_locked(boolean barrier, boolean background) {
+    struct newfs_buf_snap* snaps;
+    int* freed     = NULL;
+    int  freed_cnt = 0;
+    int  cnt, i;
+    int  ret    = NEWFS_ERROR_NONE;
+    int  wb_ret = newfs_writeback();                  /* 失败的inode留待下次，其余的照常提交 */
+
+    cnt = newfs_cache_snapshot(&snaps);
+    if (cnt < 0) {
+        newfs_super.dirty_since_ms = newfs_now_ms();  /* 过期后重试 */
+        return cnt;
+    }
+    if (wb_ret == NEWFS_ERROR_NONE) {                 /* 写回失败的inode可能还引用推迟释放的块 */
+        freed     = newfs_super.free_defer;          /* 本轮写出的inode已不再引用这些块 */
+        freed_cnt = newfs_super.free_defer_cnt;
+        newfs_super.free_defer     = NULL;
+        newfs_super.free_defer_cnt = 0;
+        newfs_super.free_defer_cap = 0;
+    }
+    newfs_super.dirty_since_ms = wb_ret == NEWFS_ERROR_NONE ? 0 : newfs_now_ms();
+    if (freed_cnt > 0 && newfs_super.journal_blks == 0) {
+        barrier = TRUE;                               /* 原地写回的要等落盘后才能释放旧块 */
+    }
+    if (cnt == 0 && !barrier) {
+        newfs_defer_append(freed, freed_cnt);
+        free(freed);
+        return wb_ret;
+    }
+
+    pthread_mutex_lock(&newfs_super.io_lock);         /* 先于放开lock取得，之后的写都排在这批之后 */
+    pthread_mutex_unlock(&newfs_super.lock);
+    if (newfs_super.journal_blks > 0) {
+        ret = newfs_journal_commit(snaps, cnt);
+        if (ret == NEWFS_ERROR_NONE && background && 
+            newfs_journal_checkpoint(FALSE) != NEWFS_ERROR_NONE) {
+            NEWFS_DBG("[%s] checkpoint error\n", __func__);  /* 已提交，下次再做 */
+        }
+    }
+    else {
+        newfs_sched_plug();
+        for (i = 0; i < cnt; i++) {
+            if (newfs_driver_write(NEWFS_BLKS_SZ(snaps[i].blkno), snaps[i].data, 
+                                   NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE) {
+                ret = -NEWFS_ERROR_IO;
+            }
+        }
+        if (newfs_sched_unplug() != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+        if (ret == NEWFS_ERROR_NONE && barrier) {
+            ret = newfs_driver_flush();
+        }
+    }
+    pthread_mutex_unlock(&newfs_super.io_lock);
+    pthread_mutex_lock(&newfs_super.lock);
+
+    if (newfs_super.journal_blks > 0 && ret == NEWFS_ERROR_NONE) {
+        free(snaps);                                  /* 各块已归日志所有 */
+        newfs_journal_reap();
+    }
+    else {
+        newfs_cache_release(snaps, cnt, ret != NEWFS_ERROR_NONE);
+    }
+    if (ret != NEWFS_ERROR_NONE) {
+        newfs_defer_append(freed, freed_cnt);         /* 旧inode仍是磁盘上的版本，继续保留 */
+        free(freed);
+        newfs_super.dirty_since_ms = newfs_now_ms();  /* 过期后重试 */
+        return ret;
+    }
+    if (freed_cnt > 0) {
+        newfs_free_data_list(freed, freed_cnt);       /* 新inode已落盘，此时才释放并discard */
+        newfs_super.dirty_since_ms = newfs_now_ms();  /* 位图的修改由下一轮写回 */
+    }
+    free(freed);
+    newfs_super.flush_blks += cnt;
+    return wb_ret;
+}
+/**
+ * @brief 立即写回全部修改，用于fsync/flush
+ *
+ * @param barrier 是否等待落盘
+ * @return int
+ */
+int newfs_writeback_sync(boolean barrier) {
+    int ret;
+    pthread_mutex_lock(&newfs_super.lock);
+    newfs_super.flush_sync_cnt++;
+    ret = newfs_writeback_locked(barrier, FALSE);
+    pthread_mutex_unlock(&newfs_super.lock);
+    return ret;
+}
+/**
+ * @brief 卸载时写回全部修改，并把日志中的块全部写回原位
+ *
+ * @return int
+ */
+int newfs_writeback_final() {
+    int ret;
+    uint64_t start, end;
+
+    pthread_mutex_lock(&newfs_super.lock);
+    ret = newfs_writeback_locked(TRUE, FALSE);
+    if (ret == NEWFS_ERROR_NONE && 
+        newfs_bitmap_dirty(&newfs_super.bm_data, NEWFS_BLK_SZ(), &start, &end)) {
+        ret = newfs_writeback_locked(TRUE, FALSE);    /* 上一轮落盘后才释放的数据块 */
+    }
+    if (ret == NEWFS_ERROR_NONE && newfs_super.journal_blks > 0) {
+        pthread_mutex_lock(&newfs_super.io_lock);
+        ret = newfs_journal_checkpoint(TRUE);
+        pthread_mutex_unlock(&newfs_super.io_lock);
+        newfs_journal_reap();
+    }
+    pthread_mutex_unlock(&newfs_super.lock);
+    return ret;
+}
+
+static void* newfs_flusher_main(void* arg) {
+    struct timespec ts;
+    uint64_t now, due;
+    (void)arg;
+
+    pthread_mutex_lock(&newfs_super.lock);
+    while (!newfs_super.flusher_stop) {
+        now = newfs_now_ms();
+        if (newfs_super.dirty_since_ms != 0 && newfs_dirty_bytes() >= newfs_super.dirty_limit) {
+            newfs_super.flush_pressure_cnt++;
+        }
+        else if (newfs_super.dirty_since_ms != 0 && 
+                 now >= newfs_super.dirty_since_ms + newfs_super.flush_age_ms) {
+            newfs_super.flush_age_cnt++;
+        }
+        else {
+            due = (newfs_super.dirty_since_ms != 0 ? newfs_super.dirty_since_ms : now) 
+                  + newfs_super.flush_age_ms;
+            ts.tv_sec  = due / 1000;
+            ts.tv_nsec = (due % 1000) * 1000000;
+            pthread_cond_timedwait(&newfs_super.flush_cond, &newfs_super.lock, &ts);
+            continue;
+        }
+        if (newfs_writeback_locked(FALSE, TRUE) != NEWFS_ERROR_NONE) {
+            NEWFS_DBG("[%s] writeback error, retry in %dms\n", __func__, newfs_super.flush_age_ms);
+            due        = newfs_now_ms() + newfs_super.flush_age_ms;
+            ts.tv_sec  = due / 1000;
+            ts.tv_nsec = (due % 1000) * 1000000;
+            pthread_cond_timedwait(&newfs_super.flush_cond, &newfs_super.lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&newfs_super.lock);
+    return NULL;
+}
+/**
+ * @brief 启动写回线程
+ *
+ * @param flush_age_ms 修改最多停留的时间，不大于0时不启动，只在fsync/flush和卸载时写回
+ * @param dirty_kb 脏数据水位，不大于0时使用默认值
+ * @return int
+ */
+int newfs_flusher_start(int flush_age_ms, int dirty_kb) {
+    pthread_condattr_t attr;
+
+    newfs_super.flusher_running    = FALSE;
+    newfs_super.flusher_stop       = FALSE;
+    newfs_super.flush_age_ms       = flush_age_ms;
+    newfs_super.dirty_limit        = (uint64_t)(dirty_kb > 0 ? dirty_kb : NEWFS_DIRTY_DEFAULT_KB) * 1024;
+    newfs_super.flush_age_cnt      = 0;
+    newfs_super.flush_pressure_cnt = 0;
+    newfs_super.flush_sync_cnt     = 0;
+    newfs_super.flush_blks         = 0;
+    newfs_super.dirty_since_ms     = 0;               /* 挂载时读入目录不算修改 */
+    if (flush_age_ms <= 0) {
+        return NEWFS_ERROR_NONE;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); /* 与newfs_now_ms一致 */
+    pthread_cond_init(&newfs_super.flush_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&newfs_super.flusher, NULL, newfs_flusher_main, NULL) != 0) {
+        pthread_cond_destroy(&newfs_super.flush_cond);
+        return -NEWFS_ERROR_IO;
+    }
+    newfs_super.flusher_running = TRUE;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 停止写回线程，剩余的修改由调用者写回
+ */
+void newfs_flusher_stop() {
+    if (!newfs_super.flusher_running) {
+        return;
+    }
+    pthread_mutex_lock(&newfs_super.lock);
+    newfs_super.flusher_stop = TRUE;
+    pthread_cond_signal(&newfs_super.flush_cond);
+    pthread_mutex_unlock(&newfs_super.lock);
+    pthread_join(newfs_super.flusher, NULL);
+    pthread_cond_destroy(&newfs_super.flush_cond);
+    newfs_super.flusher_running = FALSE;
+}